@@ -6,9 +6,29 @@ int fd_stdout;
 int fd_stderr;
 int fd_stdin;
 
+// Read by __kernel_syscall in kernel_sc.S
+CLINK int __kernel_have_sysenter;
+int __kernel_have_sysenter;
+
+// CPUID leaf 1 EDX bit 11. Early family 6 CPUs set it without supporting
+// SYSENTER.
+static int HaveSysenter() {
+    unsigned long eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    unsigned long family = (eax >> 8) & 0xF;
+    unsigned long model = (eax >> 4) & 0xF;
+    unsigned long stepping = eax & 0xF;
+    if(family == 6 && model < 3 && stepping < 3) {
+        return 0;
+    }
+    return (edx & (1 << 11)) != 0;
+}
+
 int _start(int argc, char** argv) {
     int rc;
 
+    __kernel_have_sysenter = HaveSysenter();
+
     fd_stdout = open(0, "vga", O_RDWR);
     fd_stderr = fd_stdout;
     fd_stdin = -1;
@@ -17,7 +37,7 @@ int _start(int argc, char** argv) {
 
     close(fd_stdout);
 
-    return rc;
+    exit(rc);
 }
 
 struct exeh_t {
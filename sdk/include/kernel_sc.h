@@ -23,6 +23,9 @@ CLINK void close(int fd);
 CLINK void seek(int fd, int whence, int position);
 CLINK int tell(int fd);
 CLINK int poll_kbd(int id, Keyboard_Event* buf);
+// Returns the thread id of the copy, 0 in the copy itself and -1 on failure
+CLINK int fork();
+CLINK void exit(int rc) __attribute__((noreturn));
 
 #endif /* KERNEL_SYSCALL_H */
 
@@ -0,0 +1,152 @@
+#include "common.h"
+#include "acpi.h"
+#include "utils.h"
+#include "logging.h"
+#include "vm.h"
+
+// Only the RSDT is used. Its entries are 32 bit, which is all we could map
+// anyway; firmware that has an XSDT keeps an RSDT next to it.
+
+#define BDA_EBDA_SEGMENT (0x40E)
+#define BIOS_ROM_START (0xE0000)
+#define BIOS_ROM_END (0x100000)
+
+struct ACPI_RSDP {
+    char signature[8];
+    u8 checksum;
+    char oem_id[6];
+    u8 revision;
+    u32 rsdt_addr;
+} PACKED;
+
+static u32 giRSDT;
+
+static bool Checksum(const void* p, u32 len) {
+    u8 sum = 0;
+    for(u32 i = 0; i < len; i++) {
+        sum += ((const u8*)p)[i];
+    }
+    return sum == 0;
+}
+
+static bool SignatureEquals(const char* a, const char* b, u32 len) {
+    for(u32 i = 0; i < len; i++) {
+        if(a[i] != b[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Looks for the RSDP on 16 byte boundaries of [start, end)
+static bool ScanRSDP(u32 start, u32 end) {
+    u32 first_page = start & 0xFFFFF000;
+    u32 page_count = (end - first_page + 4095) / 4096;
+    auto base = (const u8*)MM_VirtualMapKernel(first_page, page_count, 0);
+    if(!base) {
+        return false;
+    }
+
+    bool found = false;
+    for(u32 addr = start; addr + sizeof(ACPI_RSDP) <= end; addr += 16) {
+        auto rsdp = (const ACPI_RSDP*)(base + (addr - first_page));
+        if(SignatureEquals(rsdp->signature, "RSD PTR ", 8) && Checksum(rsdp, sizeof(ACPI_RSDP))) {
+            giRSDT = rsdp->rsdt_addr;
+            logprintf("acpi: RSDP at %xp revision %d, RSDT at %xp\n", addr, rsdp->revision, giRSDT);
+            found = true;
+            break;
+        }
+    }
+
+    MM_VirtualUnmapKernel((void*)base, page_count);
+    return found;
+}
+
+bool ACPI_Init() {
+    // The first KiB of the EBDA, then the BIOS ROM
+    auto bda = (const u8*)MM_VirtualMapKernel(0, 1, 0);
+    u32 ebda = 0;
+    if(bda) {
+        ebda = (u32)(*(const u16*)(bda + BDA_EBDA_SEGMENT)) << 4;
+        MM_VirtualUnmapKernel((void*)bda);
+    }
+
+    if((ebda == 0 || !ScanRSDP(ebda, ebda + 1024)) && !ScanRSDP(BIOS_ROM_START, BIOS_ROM_END)) {
+        logprintf("acpi: no RSDP\n");
+        return false;
+    }
+    return true;
+}
+
+// Maps the whole table at `phys`, whatever its length
+static const ACPI_SDT_Header* MapSDT(u32 phys, u32* page_count) {
+    u32 offset = phys & 0xFFF;
+    *page_count = (offset + sizeof(ACPI_SDT_Header) + 4095) / 4096;
+    auto base = (const u8*)MM_VirtualMapKernel(phys & 0xFFFFF000, *page_count, 0);
+    if(!base) {
+        return NULL;
+    }
+
+    u32 length = ((const ACPI_SDT_Header*)(base + offset))->length;
+    u32 needed = (offset + length + 4095) / 4096;
+    if(length < sizeof(ACPI_SDT_Header)) {
+        MM_VirtualUnmapKernel((void*)base, *page_count);
+        return NULL;
+    }
+    if(needed > *page_count) {
+        MM_VirtualUnmapKernel((void*)base, *page_count);
+        *page_count = needed;
+        base = (const u8*)MM_VirtualMapKernel(phys & 0xFFFFF000, *page_count, 0);
+        if(!base) {
+            return NULL;
+        }
+    }
+
+    auto ret = (const ACPI_SDT_Header*)(base + offset);
+    if(!Checksum(ret, ret->length)) {
+        logprintf("acpi: bad checksum on table at %xp\n", phys);
+        MM_VirtualUnmapKernel((void*)base, *page_count);
+        return NULL;
+    }
+    return ret;
+}
+
+static void UnmapSDT(const ACPI_SDT_Header* table) {
+    u32 offset = (u32)table & 0xFFF;
+    MM_VirtualUnmapKernel((void*)((u32)table & 0xFFFFF000), (offset + table->length + 4095) / 4096);
+}
+
+const ACPI_SDT_Header* ACPI_MapTable(const char* sig) {
+    if(giRSDT == 0) {
+        return NULL;
+    }
+
+    u32 rsdt_pages;
+    auto rsdt = MapSDT(giRSDT, &rsdt_pages);
+    if(!rsdt) {
+        return NULL;
+    }
+
+    const ACPI_SDT_Header* ret = NULL;
+    auto entries = (const u32*)(rsdt + 1);
+    u32 count = (rsdt->length - sizeof(ACPI_SDT_Header)) / sizeof(u32);
+    for(u32 i = 0; i < count && !ret; i++) {
+        u32 pages;
+        auto table = MapSDT(entries[i], &pages);
+        if(!table) {
+            continue;
+        }
+        if(SignatureEquals(table->signature, sig, 4)) {
+            ret = table;
+        } else {
+            UnmapSDT(table);
+        }
+    }
+
+    UnmapSDT(rsdt);
+    return ret;
+}
+
+void ACPI_UnmapTable(const ACPI_SDT_Header* table) {
+    UnmapSDT(table);
+}
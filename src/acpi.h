@@ -0,0 +1,30 @@
+#ifndef KERNEL_ACPI_H
+#define KERNEL_ACPI_H
+
+// ACPI table discovery
+
+#include "common.h"
+
+struct ACPI_SDT_Header {
+    char signature[4];
+    u32 length;
+    u8 revision;
+    u8 checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    u32 oem_revision;
+    u32 creator_id;
+    u32 creator_revision;
+} PACKED;
+
+static_assert(sizeof(ACPI_SDT_Header) == 36);
+
+// Finds the RSDP in the BIOS areas; returns false if there's no ACPI
+bool ACPI_Init();
+
+// Maps the first table with signature `sig` (e.g. "APIC") into the kernel
+// address space; returns NULL if there's none or it's corrupt
+const ACPI_SDT_Header* ACPI_MapTable(const char* sig);
+void ACPI_UnmapTable(const ACPI_SDT_Header* table);
+
+#endif /* KERNEL_ACPI_H */
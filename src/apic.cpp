@@ -0,0 +1,369 @@
+#include "common.h"
+#include "apic.h"
+#include "acpi.h"
+#include "utils.h"
+#include "logging.h"
+#include "port_io.h"
+#include "interrupts.h"
+#include "cpu.h"
+#include "vm.h"
+
+// The MADT lists the local APICs and IOAPICs and how the ISA IRQs are wired
+// to IOAPIC inputs (global system interrupts). ISA IRQs keep the vectors
+// they had on the 8259, so handlers don't need to know which controller is
+// in charge. The local APIC ranks interrupts by the upper nibble of their
+// vector, so a vector picks its priority; the task priority is left at 0 so
+// all of them get delivered.
+
+#define LAPIC_REG_ID        (0x020)
+#define LAPIC_REG_TPR       (0x080)
+#define LAPIC_REG_EOI       (0x0B0)
+#define LAPIC_REG_SVR       (0x0F0)
+#define LAPIC_REG_ICR_LOW   (0x300)
+#define LAPIC_REG_ICR_HIGH  (0x310)
+#define LAPIC_REG_LVT_LINT0 (0x350)
+
+#define LAPIC_SVR_ENABLE    (0x100)
+#define LAPIC_LVT_MASKED    (1 << 16)
+#define LAPIC_ICR_PENDING   (1 << 12)
+
+#define IOAPIC_REG_SELECT   (0x00)
+#define IOAPIC_REG_WINDOW   (0x10)
+#define IOAPIC_VERSION      (0x01)
+#define IOAPIC_REDIR(n)     (0x10 + 2 * (n))
+
+#define IOAPIC_REDIR_ACTIVE_LOW (1 << 13)
+#define IOAPIC_REDIR_LEVEL      (1 << 15)
+#define IOAPIC_REDIR_MASKED     (1 << 16)
+
+#define MADT_TYPE_LAPIC          (0)
+#define MADT_TYPE_IOAPIC         (1)
+#define MADT_TYPE_OVERRIDE       (2)
+#define MADT_TYPE_LAPIC_ADDRESS  (5)
+
+#define MADT_LAPIC_ENABLED       (1)
+#define MADT_LAPIC_ONLINE_CAPABLE (2)
+
+// Polarity and trigger mode of an interrupt source override
+#define MPS_POLARITY_MASK   (0x3)
+#define MPS_POLARITY_LOW    (0x3)
+#define MPS_TRIGGER_MASK    (0xC)
+#define MPS_TRIGGER_LEVEL   (0xC)
+
+#define IOAPICS_MAX (4)
+#define ISA_IRQS (16)
+
+struct MADT {
+    ACPI_SDT_Header hdr;
+    u32 lapic_addr;
+    u32 flags;
+} PACKED;
+
+struct MADT_Entry {
+    u8 type;
+    u8 length;
+} PACKED;
+
+struct MADT_LAPIC {
+    MADT_Entry hdr;
+    u8 processor_id;
+    u8 apic_id;
+    u32 flags;
+} PACKED;
+
+struct MADT_IOAPIC {
+    MADT_Entry hdr;
+    u8 id;
+    u8 reserved;
+    u32 addr;
+    u32 gsi_base;
+} PACKED;
+
+struct MADT_Override {
+    MADT_Entry hdr;
+    u8 bus;
+    u8 source;
+    u32 gsi;
+    u16 flags;
+} PACKED;
+
+struct MADT_LAPIC_Address {
+    MADT_Entry hdr;
+    u16 reserved;
+    u64 addr;
+} PACKED;
+
+struct IOAPIC {
+    u32 phys;
+    volatile u32* regs;
+    u32 gsi_base;
+    u32 gsi_count;
+};
+
+static volatile u32* gpLAPIC;
+static IOAPIC gaIOAPICs[IOAPICS_MAX];
+static u32 giIOAPICCount;
+static u32 gaISAGSI[ISA_IRQS];
+static u16 gaISAFlags[ISA_IRQS];
+static bool gaISAOverridden[ISA_IRQS];
+static u8 gaCPUs[APIC_MAX_CPUS];
+static u32 giCPUCount;
+static bool gbEnabled;
+
+static u32 LAPIC_Read(u32 reg) {
+    return gpLAPIC[reg / 4];
+}
+
+static void LAPIC_Write(u32 reg, u32 value) {
+    gpLAPIC[reg / 4] = value;
+}
+
+static u32 IOAPIC_Read(const IOAPIC* ioapic, u32 reg) {
+    ioapic->regs[IOAPIC_REG_SELECT / 4] = reg;
+    return ioapic->regs[IOAPIC_REG_WINDOW / 4];
+}
+
+static void IOAPIC_Write(const IOAPIC* ioapic, u32 reg, u32 value) {
+    ioapic->regs[IOAPIC_REG_SELECT / 4] = reg;
+    ioapic->regs[IOAPIC_REG_WINDOW / 4] = value;
+}
+
+static const IOAPIC* FindIOAPIC(u32 gsi) {
+    for(u32 i = 0; i < giIOAPICCount; i++) {
+        auto ioapic = &gaIOAPICs[i];
+        if(ioapic->gsi_base <= gsi && gsi < ioapic->gsi_base + ioapic->gsi_count) {
+            return ioapic;
+        }
+    }
+    return NULL;
+}
+
+// Collects the CPUs, IOAPICs and ISA overrides; returns the local APIC base
+static u32 ParseMADT(const MADT* madt) {
+    u32 lapic_phys = madt->lapic_addr;
+    auto p = (const u8*)(madt + 1);
+    auto end = (const u8*)madt + madt->hdr.length;
+
+    while(p + sizeof(MADT_Entry) <= end) {
+        auto entry = (const MADT_Entry*)p;
+        if(entry->length < sizeof(MADT_Entry) || p + entry->length > end) {
+            break;
+        }
+
+        switch(entry->type) {
+            case MADT_TYPE_LAPIC: {
+                auto lapic = (const MADT_LAPIC*)entry;
+                if((lapic->flags & (MADT_LAPIC_ENABLED | MADT_LAPIC_ONLINE_CAPABLE)) && giCPUCount < APIC_MAX_CPUS) {
+                    gaCPUs[giCPUCount++] = lapic->apic_id;
+                }
+                break;
+            }
+            case MADT_TYPE_IOAPIC: {
+                auto io = (const MADT_IOAPIC*)entry;
+                if(giIOAPICCount < IOAPICS_MAX) {
+                    auto ioapic = &gaIOAPICs[giIOAPICCount++];
+                    ioapic->phys = io->addr;
+                    ioapic->gsi_base = io->gsi_base;
+                } else {
+                    logprintf("apic: ignoring IOAPIC %d\n", io->id);
+                }
+                break;
+            }
+            case MADT_TYPE_OVERRIDE: {
+                auto ovr = (const MADT_Override*)entry;
+                if(ovr->bus == 0 && ovr->source < ISA_IRQS) {
+                    gaISAGSI[ovr->source] = ovr->gsi;
+                    gaISAFlags[ovr->source] = ovr->flags;
+                    gaISAOverridden[ovr->source] = true;
+                    logprintf("apic: IRQ%d -> GSI %d flags %x\n", ovr->source, ovr->gsi, ovr->flags);
+                }
+                break;
+            }
+            case MADT_TYPE_LAPIC_ADDRESS: {
+                auto addr = (const MADT_LAPIC_Address*)entry;
+                if(addr->addr < 0x100000000ULL) {
+                    lapic_phys = (u32)addr->addr;
+                }
+                break;
+            }
+        }
+
+        p += entry->length;
+    }
+
+    return lapic_phys;
+}
+
+// An ISA IRQ without an override is identity mapped, unless another IRQ was
+// moved onto its input (IRQ0 usually takes over GSI 2 from the cascade)
+static bool ISAIRQConnected(u32 irq) {
+    if(gaISAOverridden[irq]) {
+        return true;
+    }
+    for(u32 other = 0; other < ISA_IRQS; other++) {
+        if(other != irq && gaISAOverridden[other] && gaISAGSI[other] == irq) {
+            return false;
+        }
+    }
+    return irq != 2;
+}
+
+bool APIC_RouteGSI(u32 gsi, u8 vector, bool level, bool active_low) {
+    auto ioapic = FindIOAPIC(gsi);
+    if(!ioapic) {
+        return false;
+    }
+
+    u32 pin = gsi - ioapic->gsi_base;
+    u32 low = vector;
+    if(level) low |= IOAPIC_REDIR_LEVEL;
+    if(active_low) low |= IOAPIC_REDIR_ACTIVE_LOW;
+
+    // Fixed delivery, physical destination: the boot CPU
+    IOAPIC_Write(ioapic, IOAPIC_REDIR(pin) + 1, APIC_GetLocalID() << 24);
+    IOAPIC_Write(ioapic, IOAPIC_REDIR(pin), low);
+    return true;
+}
+
+void APIC_MaskIRQ(u32 irq, bool masked) {
+    ASSERT(irq < ISA_IRQS);
+
+    u32 gsi = gaISAGSI[irq];
+    auto ioapic = FindIOAPIC(gsi);
+    if(!ioapic || !ISAIRQConnected(irq)) {
+        return;
+    }
+
+    u32 reg = IOAPIC_REDIR(gsi - ioapic->gsi_base);
+    u32 low = IOAPIC_Read(ioapic, reg);
+    if(masked) {
+        low |= IOAPIC_REDIR_MASKED;
+    } else {
+        low &= ~IOAPIC_REDIR_MASKED;
+    }
+    IOAPIC_Write(ioapic, reg, low);
+}
+
+// The 8259 no longer delivers through LINT0; LINT1 stays the NMI line
+static void SetupLocalAPIC() {
+    LAPIC_Write(LAPIC_REG_TPR, 0);
+    LAPIC_Write(LAPIC_REG_LVT_LINT0, LAPIC_LVT_MASKED);
+    LAPIC_Write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+bool APIC_Init() {
+    if(!CPU_HasFeatureEDX(CPUID_FEAT_EDX_APIC) || !ACPI_Init()) {
+        logprintf("apic: not available, staying on the 8259\n");
+        return false;
+    }
+
+    auto madt = (const MADT*)ACPI_MapTable("APIC");
+    if(!madt) {
+        logprintf("apic: no MADT, staying on the 8259\n");
+        return false;
+    }
+
+    for(u32 irq = 0; irq < ISA_IRQS; irq++) {
+        gaISAGSI[irq] = irq;
+    }
+    u32 lapic_phys = ParseMADT(madt);
+    ACPI_UnmapTable(&madt->hdr);
+
+    if(giIOAPICCount == 0) {
+        logprintf("apic: no IOAPIC, staying on the 8259\n");
+        return false;
+    }
+
+    gpLAPIC = (volatile u32*)MM_VirtualMapKernel(lapic_phys, 1, MM_MAP_WRITE | MM_MAP_NOCACHE);
+    if(!gpLAPIC) {
+        return false;
+    }
+    for(u32 i = 0; i < giIOAPICCount; i++) {
+        auto ioapic = &gaIOAPICs[i];
+        // The registers sit at the start of a page, but not always the
+        // start of the one the address falls in
+        auto page = (u8*)MM_VirtualMapKernel(ioapic->phys & 0xFFFFF000, 1, MM_MAP_WRITE | MM_MAP_NOCACHE);
+        if(!page) {
+            return false;
+        }
+        ioapic->regs = (volatile u32*)(page + (ioapic->phys & 0xFFF));
+        ioapic->gsi_count = ((IOAPIC_Read(ioapic, IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+        logprintf("apic: IOAPIC at %xp GSI %d-%d\n", ioapic->phys, ioapic->gsi_base, ioapic->gsi_base + ioapic->gsi_count - 1);
+    }
+
+    u32 flags;
+    asm volatile("pushf\npop %0\ncli" : "=r"(flags) : : "memory");
+
+    // Carry the 8259 masks over, then silence it for good
+    u32 pic_masks = inb(0x21) | (inb(0xA1) << 8);
+    outb(0xA1, 0xFF);
+    outb(0x21, 0xFF);
+
+    for(u32 i = 0; i < giIOAPICCount; i++) {
+        for(u32 pin = 0; pin < gaIOAPICs[i].gsi_count; pin++) {
+            IOAPIC_Write(&gaIOAPICs[i], IOAPIC_REDIR(pin), IOAPIC_REDIR_MASKED);
+        }
+    }
+
+    SetupLocalAPIC();
+    gbEnabled = true;
+
+    for(u32 irq = 0; irq < ISA_IRQS; irq++) {
+        if(!ISAIRQConnected(irq)) {
+            continue;
+        }
+        u32 iflags = gaISAFlags[irq];
+        // ISA interrupts are edge triggered and active high unless the
+        // override says otherwise
+        bool level = (iflags & MPS_TRIGGER_MASK) == MPS_TRIGGER_LEVEL;
+        bool active_low = (iflags & MPS_POLARITY_MASK) == MPS_POLARITY_LOW;
+        if(APIC_RouteGSI(gaISAGSI[irq], IRQ0 + irq, level, active_low)) {
+            APIC_MaskIRQ(irq, (pic_masks & (1 << irq)) != 0);
+        } else {
+            logprintf("apic: no IOAPIC input for IRQ%d\n", irq);
+        }
+    }
+
+    asm volatile("push %0\npopf" : : "r"(flags) : "memory", "cc");
+
+    logprintf("apic: local APIC %d at %xp, %d CPU(s)\n", APIC_GetLocalID(), lapic_phys, giCPUCount);
+    return true;
+}
+
+void APIC_InitCPU() {
+    ASSERT(gbEnabled);
+    SetupLocalAPIC();
+}
+
+void APIC_SendIPI(u32 apic_id, u32 command) {
+    u32 flags;
+    asm volatile("pushf\npop %0\ncli" : "=r"(flags) : : "memory");
+
+    LAPIC_Write(LAPIC_REG_ICR_HIGH, apic_id << 24);
+    LAPIC_Write(LAPIC_REG_ICR_LOW, command);
+    while(LAPIC_Read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING) {
+        asm volatile("pause");
+    }
+
+    asm volatile("push %0\npopf" : : "r"(flags) : "memory", "cc");
+}
+
+bool APIC_IsEnabled() {
+    return gbEnabled;
+}
+
+void APIC_EOI() {
+    LAPIC_Write(LAPIC_REG_EOI, 0);
+}
+
+u32 APIC_GetCPUs(u8* apic_ids, u32 max_count) {
+    u32 count = giCPUCount < max_count ? giCPUCount : max_count;
+    for(u32 i = 0; i < count; i++) {
+        apic_ids[i] = gaCPUs[i];
+    }
+    return count;
+}
+
+u32 APIC_GetLocalID() {
+    return gpLAPIC ? LAPIC_Read(LAPIC_REG_ID) >> 24 : 0;
+}
@@ -0,0 +1,41 @@
+#ifndef KERNEL_APIC_H
+#define KERNEL_APIC_H
+
+// Local APIC and IOAPIC interrupt controllers
+
+#include "common.h"
+
+#define APIC_SPURIOUS_VECTOR (0xFF)
+#define APIC_MAX_CPUS (16)
+
+// Interrupt command register values for APIC_SendIPI
+#define APIC_IPI_FIXED(vector) (0x4000 | (vector))
+#define APIC_IPI_INIT (0x4500)
+#define APIC_IPI_STARTUP(page) (0x4600 | (page))
+
+// Routes the ISA IRQs through the IOAPIC and disables the 8259s. IRQ n
+// keeps vector IRQ0 + n and stays masked if it was masked on the 8259.
+// Returns false, leaving the 8259s in charge, if ACPI doesn't describe an
+// IOAPIC.
+bool APIC_Init();
+// Enables the local APIC of another CPU
+void APIC_InitCPU();
+bool APIC_IsEnabled();
+
+// Signals the end of an interrupt to the local APIC
+void APIC_EOI();
+
+// Masks or unmasks ISA IRQ `irq` (0-15) on the IOAPIC
+void APIC_MaskIRQ(u32 irq, bool masked);
+
+// Routes global system interrupt `gsi` to `vector` on the boot CPU.
+// Level triggered sources (PCI) are usually active low.
+bool APIC_RouteGSI(u32 gsi, u8 vector, bool level, bool active_low);
+
+// Local APIC IDs of the processors that can be started, boot CPU included
+u32 APIC_GetCPUs(u8* apic_ids, u32 max_count);
+u32 APIC_GetLocalID();
+// Sends an interprocessor interrupt and waits until it's delivered
+void APIC_SendIPI(u32 apic_id, u32 command);
+
+#endif /* KERNEL_APIC_H */
@@ -0,0 +1,71 @@
+#ifndef KERNEL_CPU_H
+#define KERNEL_CPU_H
+
+#include "common.h"
+
+// CPUID leaf 1 feature bits
+#define CPUID_FEAT_EDX_PSE  (1 << 3)
+#define CPUID_FEAT_EDX_PAE  (1 << 6)
+#define CPUID_FEAT_EDX_APIC (1 << 9)
+#define CPUID_FEAT_EDX_SEP  (1 << 11)
+#define CPUID_FEAT_EDX_PGE  (1 << 13)
+
+// CPUID leaf 0x80000001 feature bits
+#define CPUID_EXT_FEAT_EDX_NX (1 << 20)
+
+#define CR4_PSE (1 << 4)
+#define CR4_PAE (1 << 5)
+#define CR4_PGE (1 << 7)
+
+#define MSR_SYSENTER_CS     (0x174)
+#define MSR_SYSENTER_ESP    (0x175)
+#define MSR_SYSENTER_EIP    (0x176)
+#define MSR_EFER            (0xC0000080)
+
+#define EFER_NXE (1 << 11)
+
+inline void CPU_CPUID(u32 leaf, u32* eax, u32* ebx, u32* ecx, u32* edx) {
+    u32 a, b, c, d;
+    asm volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(leaf), "c"(0));
+    if(eax) *eax = a;
+    if(ebx) *ebx = b;
+    if(ecx) *ecx = c;
+    if(edx) *edx = d;
+}
+
+inline bool CPU_HasFeatureEDX(u32 feature) {
+    u32 edx;
+    CPU_CPUID(1, NULL, NULL, NULL, &edx);
+    return (edx & feature) != 0;
+}
+
+// Extended leaves may not exist at all on older CPUs
+inline bool CPU_HasExtFeatureEDX(u32 feature) {
+    u32 max, edx;
+    CPU_CPUID(0x80000000, &max, NULL, NULL, NULL);
+    if(max < 0x80000001) {
+        return false;
+    }
+    CPU_CPUID(0x80000001, NULL, NULL, NULL, &edx);
+    return (edx & feature) != 0;
+}
+
+inline u32 CPU_ReadCR4() {
+    u32 ret;
+    asm volatile("mov %%cr4, %0" : "=r"(ret));
+    return ret;
+}
+
+inline void CPU_WriteCR4(u32 value) {
+    asm volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+inline void CPU_WriteMSR(u32 msr, u32 lo, u32 hi) {
+    asm volatile("wrmsr" : : "c"(msr), "a"(lo), "d"(hi));
+}
+
+inline void CPU_ReadMSR(u32 msr, u32* lo, u32* hi) {
+    asm volatile("rdmsr" : "=a"(*lo), "=d"(*hi) : "c"(msr));
+}
+
+#endif /* KERNEL_CPU_H */
@@ -2,6 +2,9 @@
 #include "volumes.h"
 #include "memory.h"
 #include "utils.h"
+#include "pfalloc.h"
+#include "vm.h"
+#include "swap.h"
 
 #include "uart.h"
 #include "pc_vga.h"
@@ -17,10 +20,13 @@ enum Filetype {
     FT_VGA, // VGA framebuffer
     FT_Memory, // Memory access
     FT_TTY, // Teletype
+    FT_MemInfo, // Memory usage statistics
 };
 
 #define MAX_OPEN_FILES (16)
 #define MAX_CHARDEVS (10)
+#define MEMINFO_MAX (1024)
+#define MEMINFO_PROGRAMS (16)
 
 struct Character_Device {
     bool used;
@@ -47,6 +53,9 @@ struct File_State {
         struct TTY {
             Character_Device* dev;
         } tty;
+        struct MemInfo {
+            u32 offset;
+        } meminfo;
     } state;
 };
 
@@ -98,6 +107,66 @@ int CharDev_Register(void* user, Character_Device_Descriptor* op) {
     return rc;
 }
 
+static void MemInfo_Append(char* buf, u32* len, const char* label, u32 kib) {
+    char digits[12];
+    u32 count = 0;
+
+    do {
+        digits[count++] = '0' + (kib % 10);
+        kib /= 10;
+    } while(kib);
+
+    while(*label && *len < MEMINFO_MAX) {
+        buf[(*len)++] = *label++;
+    }
+    while(count > 0 && *len < MEMINFO_MAX) {
+        buf[(*len)++] = digits[--count];
+    }
+    label = " kB\n";
+    while(*label && *len < MEMINFO_MAX) {
+        buf[(*len)++] = *label++;
+    }
+}
+
+// Renders the current statistics; returns the length of the text
+static u32 MemInfo_Render(char* buf) {
+    u32 len = 0;
+    PFA_Stats pfa;
+    Kmalloc_Stats km;
+    Swap_Stats swap;
+
+    PFA_GetStats(&pfa);
+    Mem_GetStats(&km);
+    Swap_GetStats(&swap);
+
+    MemInfo_Append(buf, &len, "MemTotal:     ", pfa.total_frames * 4);
+    MemInfo_Append(buf, &len, "MemFree:      ", pfa.free_frames * 4);
+    MemInfo_Append(buf, &len, "HighTotal:    ", pfa.high_frames * 4);
+    MemInfo_Append(buf, &len, "LargestFree:  ", pfa.largest_free_frames * 4);
+    MemInfo_Append(buf, &len, "Kernel:       ", pfa.kernel_frames * 4);
+    MemInfo_Append(buf, &len, "Program:      ", pfa.program_frames * 4);
+    MemInfo_Append(buf, &len, "ZeroPool:     ", pfa.zero_pool_frames * 4);
+    MemInfo_Append(buf, &len, "PageTables:   ", MM_GetPageTableCount() * 4);
+    MemInfo_Append(buf, &len, "Slab:         ", km.slab_bytes / 1024);
+    MemInfo_Append(buf, &len, "SlabUsed:     ", km.slab_used_bytes / 1024);
+    MemInfo_Append(buf, &len, "Vmalloc:      ", km.vmalloc_bytes / 1024);
+    MemInfo_Append(buf, &len, "SwapTotal:    ", swap.total_pages * 4);
+    MemInfo_Append(buf, &len, "SwapFree:     ", swap.free_pages * 4);
+
+    // Resident memory of each program, named by its page directory
+    u32 programs[MEMINFO_PROGRAMS];
+    u32 count = PFA_GetPrograms(programs, MEMINFO_PROGRAMS);
+    for(u32 i = 0; i < count; i++) {
+        char label[] = "Program 00000000: ";
+        for(u32 d = 0; d < 8; d++) {
+            label[15 - d] = "0123456789abcdef"[(programs[i] >> (d * 4)) & 0xF];
+        }
+        MemInfo_Append(buf, &len, label, PFA_GetResident(programs[i]) / 1024);
+    }
+
+    return len;
+}
+
 static Filesystem_File_Handle FS_Open(void* user, const char* path, mode_t flags) {
     auto fs = (DevFS_State*)user;
     Filesystem_File_Handle ret = -1;
@@ -128,6 +197,13 @@ static Filesystem_File_Handle FS_Open(void* user, const char* path, mode_t flags
                 F.state.mem.addr = NULL;
                 F.state.mem.write = (flags & O_WRONLY) != 0;
             }
+        } else if(strcmp("meminfo", path)) {
+            ret = Filesystem_File_Handle(FindFreeHandle(fs));
+            if(ret != -1) {
+                auto& F = fs->files[ret];
+                F.type = FT_MemInfo;
+                F.state.meminfo.offset = 0;
+            }
         } else if(strcmp("vga", path)) {
             ret = Filesystem_File_Handle(FindFreeHandle(fs));
             if(ret != -1) {
@@ -198,6 +274,21 @@ static s32 FS_Read(void* user, Filesystem_File_Handle fd, void* dst, u32 bytes)
                     ret = 0;
                 }
                 break;
+            case FT_MemInfo:
+            {
+                char buf[MEMINFO_MAX];
+                u32 len = MemInfo_Render(buf);
+                ret = 0;
+                if(F.state.meminfo.offset < len) {
+                    ret = len - F.state.meminfo.offset;
+                    if((u32)ret > bytes) {
+                        ret = bytes;
+                    }
+                    memcpy(dst, buf + F.state.meminfo.offset, ret);
+                    F.state.meminfo.offset += ret;
+                }
+                break;
+            }
             default:
                 break;
         }
@@ -264,6 +355,9 @@ s32 FS_Tell(void* user, Filesystem_File_Handle fd) {
             case FT_Memory:
                 ret = reinterpret_cast<s32>(F.state.mem.addr);
                 break;
+            case FT_MemInfo:
+                ret = F.state.meminfo.offset;
+                break;
             case FT_Null:
             case FT_Zero:
             case FT_VGA:
@@ -303,6 +397,13 @@ s32 FS_Seek(void* user, Filesystem_File_Handle fd, whence_t whence, s32 position
             case FT_Zero:
                 ret = 0;
                 break;
+            case FT_MemInfo:
+                // Only rewinding makes sense, the text changes all the time
+                if(whence == whence_t::SET && position >= 0) {
+                    F.state.meminfo.offset = position;
+                    ret = 0;
+                }
+                break;
             default:
                 break;
         }
@@ -335,6 +436,12 @@ int FS_EOF(void* user, Filesystem_File_Handle fd) {
             case FT_VGA:
                 ret = 1;
                 break;
+            case FT_MemInfo:
+            {
+                char buf[MEMINFO_MAX];
+                ret = F.state.meminfo.offset >= MemInfo_Render(buf);
+                break;
+            }
             default:
                 break;
         }
@@ -4,6 +4,8 @@
 #include "utils.h"
 #include "memory.h"
 #include "volumes.h"
+#include "swap.h"
+#include "spinlock.h"
 
 struct Disk_Device {
     void* user;
@@ -14,6 +16,8 @@ struct Disk_Device {
 
 static Disk_Device gaDisks[MAX_DISKS];
 static u32 giDisksLastIndex = 0;
+// Drivers get one request at a time. Taken last, drivers take no other locks.
+static Kernel_Lock gDiskLock;
 
 bool Disk_Register_Device(void* user, const Disk_Device_Descriptor* desc) {
     bool ret = false;
@@ -49,6 +53,7 @@ u32 Disk_BlockSize(u32 disk) {
 }
 
 s32 Disk_Read_Blocks(u32 disk, void* buf, u32 block_count, u32 block_offset) {
+    KLock_Guard guard(&gDiskLock);
     s32 ret = -1;
     ASSERT(block_count < 0x7FFFFFFF);
 
@@ -69,6 +74,7 @@ s32 Disk_Read_Blocks(u32 disk, void* buf, u32 block_count, u32 block_offset) {
 }
 
 s32 Disk_Write_Blocks(u32 disk, const void* buf, u32 block_count, u32 block_offset) {
+    KLock_Guard guard(&gDiskLock);
     s32 ret = -1;
     ASSERT(block_count < 0x7FFFFFFF);
 
@@ -170,13 +176,17 @@ static bool IsGPT(u32 disk) {
     return ret;
 }
 
+#define MBR_TYPE_SWAP (0x82)
+
 static void ProcessMBR(u32 disk, MBR_Entry* entries) {
     for(int j = 0; j < 4; j++) {
         auto& entry = entries[j];
         Volume_Descriptor desc;
         logprintf("- Attr[%x] Type[%x] Start[%x] Count[%x]\n", entry.attr, entry.type, entry.lbs_start, entry.lbs_count);
 
-        if(entry.lbs_count > 0) {
+        if(entry.lbs_count > 0 && entry.type == MBR_TYPE_SWAP) {
+            Swap_Register(disk, entry.lbs_start, entry.lbs_count);
+        } else if(entry.lbs_count > 0) {
             desc.disk = disk;
             desc.offset = entry.lbs_start;
             desc.length = entry.lbs_count;
@@ -196,6 +206,7 @@ struct GUID {
 
 static GUID guid_Unused = {0, 0, 0, 0, {0, 0, 0, 0, 0, 0}};
 static GUID guid_BasicData = {0xEBD0A0A2, 0xB9E5, 0x4433, 0xC087, {0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7}};
+static GUID guid_Swap = {0x0657FD6D, 0xA4AB, 0x43C4, 0xE584, {0x09, 0x33, 0xC8, 0x4B, 0x4F, 0x4F}};
 //static GUID guid_EFISystem = {0xC12A7328, 0xF81F, 0x11D2, 0x4BBA, {0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B}};
 
 static bool operator==(const GUID& lhs, const GUID& rhs) {
@@ -259,6 +270,8 @@ static void ProcessGPT(u32 disk) {
                 desc.offset = entry.lba_first;
                 desc.length = entry.lba_last - entry.lba_first + 1;
                 Volume_Register(&desc);
+            } else if(type == guid_Swap) {
+                Swap_Register(disk, entry.lba_first, entry.lba_last - entry.lba_first + 1);
             }
         }
     }
@@ -0,0 +1,160 @@
+#include "common.h"
+#include "dma.h"
+#include "utils.h"
+#include "logging.h"
+#include "pfalloc.h"
+#include "vm.h"
+#include "memory.h"
+
+// A zone of memory is set aside at boot so that drivers get their buffers
+// even when physical memory is too fragmented for large contiguous runs.
+// The zone is carved into 512 byte units; besides the used bitmap, the last
+// unit of every buffer is marked so DMA_Free knows its length. Requests the
+// zone can't satisfy go to the page frame allocator.
+
+#define DMA_ZONE_SIZE (256 * 1024)
+// The zone lives below 16 MiB, within reach of ISA DMA, so it suits
+// every max_phys a driver asks for
+#define DMA_ZONE_LIMIT (16 * 1024 * 1024)
+#define DMA_UNIT (512)
+#define DMA_UNITS (DMA_ZONE_SIZE / DMA_UNIT)
+
+static u32 gZonePhys;
+static u8* gZone; // Virtual address of the zone
+static u32 gaZoneUsed[DMA_UNITS / 32];
+static u32 gaZoneLast[DMA_UNITS / 32];
+
+static bool UnitTest(const u32* bitmap, u32 unit) {
+    return (bitmap[unit / 32] & (1 << (unit % 32))) != 0;
+}
+
+static void UnitSet(u32* bitmap, u32 unit, bool value) {
+    if(value) {
+        bitmap[unit / 32] |= (1 << (unit % 32));
+    } else {
+        bitmap[unit / 32] &= ~(1 << (unit % 32));
+    }
+}
+
+// Checks the constraints of a buffer at [phys, phys + size)
+static bool Fits(u32 phys, u32 size, u32 align, u32 boundary, u32 max_phys) {
+    u32 last = phys + size - 1;
+    return
+        (phys % align) == 0 &&
+        last >= phys && last <= max_phys &&
+        (boundary == DMA_NO_BOUNDARY || phys / boundary == last / boundary);
+}
+
+void DMA_Init() {
+    if(!PFA_AllocBelow(&gZonePhys, DMA_ZONE_SIZE, DMA_ZONE_LIMIT - 1)) {
+        logprintf("dma: can't reserve zone\n");
+        return;
+    }
+
+    gZone = (u8*)MM_VirtualMapKernel(gZonePhys, DMA_ZONE_SIZE / 4096);
+    if(!gZone) {
+        logprintf("dma: can't map zone\n");
+        PFA_Free(gZonePhys);
+        return;
+    }
+
+    // Devices know it by its physical address
+    PFA_SetFlags(gZonePhys, PFA_FLAG_PINNED);
+
+    logprintf("dma: zone at %xp, %d KiB\n", gZonePhys, DMA_ZONE_SIZE / 1024);
+}
+
+static void* ZoneAlloc(u32* phys, u32 size, u32 align, u32 boundary, u32 max_phys) {
+    u32 units = (size + DMA_UNIT - 1) / DMA_UNIT;
+    u32 step = align > DMA_UNIT ? align / DMA_UNIT : 1;
+
+    if(!gZone) {
+        return NULL;
+    }
+
+    // Zone is naturally aligned to its size, so aligned units are aligned
+    // physically too
+    for(u32 first = 0; first + units <= DMA_UNITS; first += step) {
+        if(!Fits(gZonePhys + first * DMA_UNIT, size, align, boundary, max_phys)) {
+            continue;
+        }
+
+        u32 i = 0;
+        while(i < units && !UnitTest(gaZoneUsed, first + i)) {
+            i++;
+        }
+        if(i == units) {
+            for(i = 0; i < units; i++) {
+                UnitSet(gaZoneUsed, first + i, true);
+            }
+            UnitSet(gaZoneLast, first + units - 1, true);
+            *phys = gZonePhys + first * DMA_UNIT;
+            return gZone + first * DMA_UNIT;
+        }
+    }
+
+    return NULL;
+}
+
+void* DMA_Alloc(u32* phys, u32 size, u32 align, u32 boundary, u32 max_phys) {
+    KLock_Guard guard(&gMemoryLock);
+    ASSERT(phys && size > 0 && align > 0);
+    ASSERT(boundary == DMA_NO_BOUNDARY || size <= boundary);
+
+    void* ret = ZoneAlloc(phys, size, align, boundary, max_phys);
+    if(ret) {
+        return ret;
+    }
+
+    // Whole frames; blocks of the buddy allocator are aligned to their size,
+    // so asking for at least `align` bytes gets a block that is aligned
+    u32 page_count = (size + 4095) / 4096;
+    if(align > page_count * 4096) {
+        page_count = (align + 4095) / 4096;
+    }
+    u32 frames;
+    if(!PFA_AllocBelow(&frames, page_count * 4096, max_phys)) {
+        return NULL;
+    }
+    if(!Fits(frames, size, align, boundary, max_phys)) {
+        logprintf("dma: no buffer of %x bytes satisfies the constraints\n", size);
+        PFA_Free(frames);
+        return NULL;
+    }
+
+    ret = MM_VirtualMapKernel(frames, page_count);
+    if(!ret) {
+        PFA_Free(frames);
+        return NULL;
+    }
+    PFA_SetFlags(frames, PFA_FLAG_PINNED);
+
+    *phys = frames;
+    return ret;
+}
+
+void DMA_Free(void* addr) {
+    KLock_Guard guard(&gMemoryLock);
+    auto vaddr = (u8*)addr;
+
+    if(!addr) {
+        return;
+    }
+
+    if(gZone && gZone <= vaddr && vaddr < gZone + DMA_ZONE_SIZE) {
+        u32 unit = (vaddr - gZone) / DMA_UNIT;
+        bool last = false;
+        while(!last) {
+            last = UnitTest(gaZoneLast, unit);
+            UnitSet(gaZoneUsed, unit, false);
+            UnitSet(gaZoneLast, unit, false);
+            unit++;
+        }
+    } else {
+        u64 phys;
+        if(MM_MapToPhysical(&phys, addr)) {
+            MM_VirtualUnmapKernel(addr, PFA_GetSize(phys) / 4096);
+            PFA_Free(phys);
+        }
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef KERNEL_DMA_H
+#define KERNEL_DMA_H
+
+// Buffers for devices doing DMA
+
+#include "common.h"
+
+#define DMA_NO_BOUNDARY (0)
+#define DMA_NO_LIMIT (0xFFFFFFFF)
+
+void DMA_Init();
+
+// Allocate a physically contiguous buffer of `size` bytes. Its physical
+// address is a multiple of `align`, it doesn't cross a multiple of
+// `boundary` (if nonzero) and its last byte is at or below `max_phys`.
+// Returns the kernel virtual address and stores the physical one in `phys`.
+void* DMA_Alloc(u32* phys, u32 size, u32 align = 4, u32 boundary = DMA_NO_BOUNDARY, u32 max_phys = DMA_NO_LIMIT);
+void DMA_Free(void* addr);
+
+#endif /* KERNEL_DMA_H */
@@ -7,20 +7,60 @@
 #include "pfalloc.h"
 #include "vm.h"
 #include "utils.h"
+#include "sched.h"
+#include "interrupts.h"
+#include "syscalls.h"
+#include "memory.h"
+#include "smp.h"
+
+#define EXEC_STACK_SIZE (64 * 1024)
+
+// interrupts.S
+extern "C" int User_Enter(u32 entry, u32 user_esp);
+extern "C" int User_Resume(const Registers* regs);
+extern "C" void User_Exit(u32 kernel_esp, int rc);
+
+void Exec_Exit(int rc) {
+    u32 kernel_esp = Sched_GetKernelStack();
+    ASSERT(kernel_esp);
+    User_Exit(kernel_esp, rc);
+    ASSERT(!"User_Exit returned");
+}
+
+// Lays out argc and argv below `top` the way a call from C would; returns
+// the program's initial stack pointer
+static u32 PushArguments(u32 top, int argc, const char** argv) {
+    u32 strings_len = 0;
+    for(int i = 0; i < argc; i++) {
+        strings_len += strlen(argv[i]) + 1;
+    }
+
+    auto str = (char*)(top - strings_len);
+    auto user_argv = (char**)(((u32)str & ~3) - sizeof(char*) * (argc + 1));
+    for(int i = 0; i < argc; i++) {
+        u32 len = strlen(argv[i]) + 1;
+        memcpy(str, argv[i], len);
+        user_argv[i] = str;
+        str += len;
+    }
+    user_argv[argc] = NULL;
+
+    auto frame = (u32*)user_argv;
+    *--frame = (u32)user_argv;
+    *--frame = (u32)argc;
+    // Programs leave through SYSCALL_EXIT; returning faults on kernel memory
+    *--frame = KERNEL_BASE;
+    return (u32)frame;
+}
 
 int Execute_Program(Volume_Handle volume, const char* path, int argc, const char** argv) {
     int ret = EXEC_ERR_NOTFOUND;
-    int rd, fd;
+    int rd, fd, rc;
     Exec_Header hdr;
     u32 page_directory;
     u32 len, mem_len;
-    u32 program_memory, stack_memory;
     void *program;
     auto stack = (void*)0x40000000;
-    u32 mem_remain;
-    void* cur_virt;
-    u32 cur_phys;
-    bool ok;
 
     logprintf("exec: loading program '%d:/%s'\n", volume, path);
 
@@ -50,58 +90,47 @@ int Execute_Program(Volume_Handle volume, const char* path, int argc, const char
     // Switch to that page directory
     SwitchPageDirectory(page_directory);
 
-    // Load image
     File_Seek(fd, 0, whence_t::END);
     len = (u32)File_Tell(fd);
-    mem_len = (len + 4095) & 0xFFFFF000;
-
-    if(!PFA_Alloc(&program_memory, mem_len + 4096)) {
-        goto out_of_memory_pd;
+    if(len > EXEC_MAX_SIZE) {
+        logprintf("exec: image too large\n");
+        FreePageDirectory(page_directory);
+        goto invalid;
     }
 
-    if(!PFA_Alloc(&stack_memory, 4096)) {
+    // Reserve the whole program region; frames are only allocated for the
+    // pages the image and its BSS actually touch. Code and data share it,
+    // only the stack is no-execute.
+    mem_len = (EXEC_END + 4095) & 0xFFFFF000;
+
+    if(!MM_CreateArea(page_directory, (void*)0, mem_len, MM_MAP_WRITE | MM_MAP_USER | MM_MAP_EXEC)) {
         goto out_of_memory_vm;
     }
 
-    logprintf("exec: len=%x mem_len=%x program memory: %xp stack: %xp\n", len, mem_len, program_memory, stack_memory);
-    program = (void*)EXEC_START;
-    // Map program memory
-    mem_remain = mem_len;
-    cur_virt = (void*)0;
-    cur_phys = program_memory;
-    ok = true;
-    while(mem_remain != 0 && ok) {
-        logprintf("exec: remain=%d virt=%x phys=%x\n", mem_remain, cur_virt, cur_phys);
-        ok = ok && MM_VirtualMap(cur_virt, cur_phys);
-        mem_remain -= 4096;
-        cur_virt = (void*)((u8*)cur_virt + 4096);
-        cur_phys += 4096;
-    }
-    if(!ok) {
+    // The stack grows down from the top of its page
+    if(!MM_CreateArea(page_directory, (u8*)stack + 4096 - EXEC_STACK_SIZE, EXEC_STACK_SIZE, MM_MAP_WRITE | MM_MAP_USER)) {
         goto out_of_memory_vm;
     }
-    logprintf("exec: mapped program memory\n");
-    if(!MM_VirtualMap(stack, stack_memory)) {
-        goto out_of_memory_stack;
-    }
-    logprintf("exec: mapped stack memory\n");
-    memset(0x00000000, 0xCDCDCDCD, mem_len);
+
+    logprintf("exec: len=%x mem_len=%x\n", len, mem_len);
+    program = (void*)EXEC_START;
     File_Seek(fd, 0, whence_t::SET);
     rd = File_Read(program, 1, len, fd);
 
-    ((Entry_Point)hdr.addr_entry)(argc, argv);
+    // The program runs in ring 3 until it exits or faults
+    rc = User_Enter(hdr.addr_entry, PushArguments((u32)stack + 4096, argc, argv));
+    Sched_SetKernelStack(0);
+    logprintf("exec: program exited with %d\n", rc);
 
+    FreePageDirectory(page_directory);
+    File_Close(fd);
     return 0;
 notfound:
     return EXEC_ERR_NOTFOUND;
 invalid:
     ret = EXEC_ERR_NOTANEXE;
     goto error;
-out_of_memory_stack:
-    PFA_Free(stack_memory);
 out_of_memory_vm:
-    PFA_Free(program_memory);
-    // TODO: does FreePageDirectory free the allocated page tables?
     FreePageDirectory(page_directory);
 out_of_memory_pd:
     ret = EXEC_ERR_NOMEM;
@@ -110,9 +139,60 @@ error:
     return ret;
 }
 
+// What the thread running a forked program starts out with
+struct Fork_State {
+    Registers regs;
+    u32 page_directory;
+};
+
+static void ForkedProgram(void* arg) {
+    auto state = (Fork_State*)arg;
+    Registers regs = state->regs;
+    u32 page_directory = state->page_directory;
+    kfree(state);
+
+    SwitchPageDirectory(page_directory);
+    int rc = User_Resume(&regs);
+    Sched_SetKernelStack(0);
+    logprintf("exec: forked program exited with %d\n", rc);
+
+    FreePageDirectory(page_directory);
+}
+
+// Runs a copy of the calling program on a thread of its own. The copy
+// shares the program's memory copy-on-write, so creating it costs nothing
+// but page tables; it resumes after the system call with EAX = 0.
+static void SC_Fork(Registers* regs) {
+    regs->eax = (u32)-1;
+
+    auto state = (Fork_State*)kmalloc(sizeof(Fork_State));
+    if(!state) {
+        return;
+    }
+    if(!CloneAddressSpace(SMP_LOCAL(page_directory), &state->page_directory)) {
+        logprintf("exec: out of memory (fork)\n");
+        kfree(state);
+        return;
+    }
+    state->regs = *regs;
+    state->regs.eax = 0;
+
+    u32 page_directory = state->page_directory;
+    s32 id = Thread_Create(ForkedProgram, state);
+    if(id == -1) {
+        FreePageDirectory(page_directory);
+        kfree(state);
+        return;
+    }
+    regs->eax = (u32)id;
+}
+
 static const char* argv_init[] = {"/COMMAND.EXE"};
 
 void Spawn_Init() {
+    RegisterSyscall<Exec_Exit, SC_EBX>(SYSCALL_EXIT);
+    RegisterSyscallHandler(SYSCALL_FORK, SC_Fork);
+
     u32 max_volumes = Volume_GetCount();
     for(u32 vol = 1; vol < max_volumes; vol++) {
         auto res = Execute_Program(vol, "/COMMAND.EXE", 1, argv_init);
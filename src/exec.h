@@ -7,8 +7,12 @@
 #define EXEC_ERR_NOTFOUND (-1)
 #define EXEC_ERR_NOTANEXE (-2)
 #define EXEC_ERR_NOMEM (-3)
+// Exit code of a program killed by a fault
+#define EXEC_ERR_FAULT (-4)
 
 int Execute_Program(Volume_Handle volume, const char* path, int argc, const char** argv);
+// Ends the program running on the calling thread; Execute_Program returns
+void Exec_Exit(int rc);
 void Spawn_Init();
 
 #endif /* KERNEL_EXEC_H */
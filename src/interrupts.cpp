@@ -4,6 +4,12 @@
 #include "utils.h"
 #include "logging.h"
 #include "vm.h"
+#include "sched.h"
+#include "cpu.h"
+#include "exec.h"
+#include "apic.h"
+#include "smp.h"
+#include "syscalls.h"
 
 #define GDT_ACCESSED    (0x01)
 #define GDT_READWRITE   (0x02)
@@ -19,6 +25,14 @@
 #define GDT_KERNEL_CODE (GDT_KERNEL_DATA | GDT_EXECUTABLE)
 #define GDT_USER_DATA (GDT_PRESENT | GDT_PRIV(3) | GDT_TYPE | GDT_READWRITE)
 #define GDT_USER_CODE (GDT_USER_DATA | GDT_EXECUTABLE)
+#define GDT_TSS_32 (GDT_PRESENT | GDT_PRIV(0) | GDT_EXECUTABLE | GDT_ACCESSED)
+
+#define GDT_ENTRIES (7)
+#define SEL_TSS (0x28)
+#define SEL_PERCPU (SMP_SEL_PERCPU)
+
+#define IDT_GATE_KERNEL (0x8E)
+#define IDT_GATE_USER (0xEE) // Can be raised with INT from ring 3
 
 struct IDTD {
     u16 limit;
@@ -44,10 +58,27 @@ struct GDT_Entry {
     u8 base_high;
 } PACKED;
 
+// Only the ring 0 stack fields are used; threads are switched in software
+struct TSS {
+    u32 link;
+    u32 esp0, ss0;
+    u32 esp1, ss1;
+    u32 esp2, ss2;
+    u32 cr3, eip, eflags;
+    u32 eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    u32 es, cs, ss, ds, fs, gs;
+    u32 ldt;
+    u16 trap;
+    u16 iomap_base;
+} PACKED;
+
+// Every CPU has its own GDT, for its TSS and its per-CPU segment
 static IDT_Entry idt[256];
-static GDT_Entry gdt[5];
+static GDT_Entry gaGDT[SMP_MAX_CPUS][GDT_ENTRIES];
+static TSS gaTSS[SMP_MAX_CPUS];
+static bool gbHaveSysenter;
 static IDTD idtd;
-static GDTD gdtd;
+static GDTD gaGDTD[SMP_MAX_CPUS];
 static Interrupt_Handler handlers[256];
 
 extern "C" void isr0();
@@ -84,6 +115,7 @@ extern "C" void isr30();
 extern "C" void isr31();
 extern "C" void isr127();
 extern "C" void isr128();
+extern "C" void isr255();
 extern "C" void irq0 ();
 extern "C" void irq1 ();
 extern "C" void irq2 ();
@@ -100,6 +132,9 @@ extern "C" void irq12();
 extern "C" void irq13();
 extern "C" void irq14();
 extern "C" void irq15();
+extern "C" void irq240();
+
+extern "C" void Sysenter_Entry();
 
 extern "C" void IDT_Init(void* idtd);
 extern "C" void GDT_Init(void* gdtd);
@@ -112,7 +147,7 @@ static void IDT_Set_Gate(u8 i, u32 base, u16 sel, u8 flags) {
     idt[i].attr = flags;
 }
 
-static void GDT_Set_Gate(u8 i, u32 base, u32 lim, u8 acc, u8 gran) {
+static void GDT_Set_Gate(GDT_Entry* gdt, u8 i, u32 base, u32 lim, u8 acc, u8 gran) {
     gdt[i].base_low = (base & 0xFFFF);
     gdt[i].base_middle = (base >> 16) & 0xFF;
     gdt[i].base_high = (base >> 24) & 0xFF;
@@ -170,31 +205,25 @@ static void PIC_Setup() {
 void PIC_Mask(int IRQ) {
     ASSERT(IRQ >= IRQ0 && IRQ <= IRQ15);
     int off = IRQ - IRQ0;
-    u8 mask;
-    if(IRQ < IRQ8) {
-        mask = inb(PIC1_DATA);
-        outb(PIC1_DATA, mask | (1 << off));
+    if(APIC_IsEnabled()) {
+        APIC_MaskIRQ(off, true);
+    } else if(IRQ < IRQ8) {
+        outb(PIC1_DATA, inb(PIC1_DATA) | (1 << off));
     } else {
-        off = off - 8;
-        mask = inb(PIC2_DATA);
-        outb(PIC2_DATA, mask | (1 << off));
+        outb(PIC2_DATA, inb(PIC2_DATA) | (1 << (off - 8)));
     }
-    logprintf("PIC masks are now %x %x\n", inb(PIC2_DATA), inb(PIC1_DATA));
 }
 
 void PIC_Unmask(int IRQ) {
     ASSERT(IRQ >= IRQ0 && IRQ <= IRQ15);
     int off = IRQ - IRQ0;
-    u8 mask;
-    if(IRQ < IRQ8) {
-        mask = inb(PIC1_DATA);
-        outb(PIC1_DATA, mask & (~(1 << off)));
+    if(APIC_IsEnabled()) {
+        APIC_MaskIRQ(off, false);
+    } else if(IRQ < IRQ8) {
+        outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << off));
     } else {
-        off = off - 8;
-        mask = inb(PIC2_DATA);
-        outb(PIC2_DATA, mask & (~(1 << off)));
+        outb(PIC2_DATA, inb(PIC2_DATA) & ~(1 << (off - 8)));
     }
-    logprintf("PIC masks are now %x %x\n", inb(PIC2_DATA), inb(PIC1_DATA));
 }
 
 static void IDT_Setup() {
@@ -265,22 +294,70 @@ static void IDT_Setup() {
 	IDT_Set_Gate(46, (u32)irq14, 0x08, 0x8E);
 	IDT_Set_Gate(47, (u32)irq15, 0x08, 0x8E);
 	IDT_Set_Gate(127, (u32)isr127, 0x08, 0x8E);
-    IDT_Set_Gate(128, (u32)isr128, 0x08, 0x8E);
+    IDT_Set_Gate(128, (u32)isr128, 0x08, IDT_GATE_USER);
+    IDT_Set_Gate(SMP_IPI_VECTOR, (u32)irq240, 0x08, IDT_GATE_KERNEL);
+    IDT_Set_Gate(APIC_SPURIOUS_VECTOR, (u32)isr255, 0x08, IDT_GATE_KERNEL);
 
     IDT_Init(&idtd);
 }
 
-static void GDT_Setup() {
-    gdtd.limit = sizeof(GDT_Entry) * 5 - 1;
-    gdtd.base = (u32)&gdt;
+static void GDT_Setup(CPU_Local* cpu) {
+    auto gdt = gaGDT[cpu->index];
+    auto& gdtd = gaGDTD[cpu->index];
+    gdtd.limit = sizeof(GDT_Entry) * GDT_ENTRIES - 1;
+    gdtd.base = (u32)gdt;
 
-    GDT_Set_Gate(0, 0, 0, 0, 0);                // Null
-    GDT_Set_Gate(1, 0, 0xFFFFFFFF, GDT_KERNEL_CODE, 0xCF); // Kernel code
-    GDT_Set_Gate(2, 0, 0xFFFFFFFF, GDT_KERNEL_DATA, 0xCF); // Kernel data
-    GDT_Set_Gate(3, 0, 0xFFFFFFFF, GDT_USER_CODE, 0xCF); // User code
-    GDT_Set_Gate(4, 0, 0xFFFFFFFF, GDT_USER_DATA, 0xCF); // User data
+    GDT_Set_Gate(gdt, 0, 0, 0, 0, 0);                // Null
+    GDT_Set_Gate(gdt, 1, 0, 0xFFFFFFFF, GDT_KERNEL_CODE, 0xCF); // Kernel code
+    GDT_Set_Gate(gdt, 2, 0, 0xFFFFFFFF, GDT_KERNEL_DATA, 0xCF); // Kernel data
+    GDT_Set_Gate(gdt, 3, 0, 0xFFFFFFFF, GDT_USER_CODE, 0xCF); // User code
+    GDT_Set_Gate(gdt, 4, 0, 0xFFFFFFFF, GDT_USER_DATA, 0xCF); // User data
+    GDT_Set_Gate(gdt, 5, (u32)&gaTSS[cpu->index], sizeof(TSS) - 1, GDT_TSS_32, 0x00); // TSS
+    GDT_Set_Gate(gdt, 6, (u32)cpu, sizeof(CPU_Local) - 1, GDT_KERNEL_DATA, 0x40); // Per-CPU
 
     GDT_Init(&gdtd);
+    // Returning to ring 3 clears it, the interrupt stubs load it again
+    asm volatile("mov %w0, %%gs" : : "r"(SEL_PERCPU));
+}
+
+static void TSS_Setup(CPU_Local* cpu) {
+    auto& tss = gaTSS[cpu->index];
+    memset(&tss, 0, sizeof(tss));
+    tss.ss0 = 0x10;
+    // No I/O permission bitmap, so ring 3 can't touch any port
+    tss.iomap_base = sizeof(tss);
+    asm volatile("ltr %w0" : : "r"(SEL_TSS));
+
+    // SYSENTER loads CS from the MSR and SS from the entry after it, and
+    // SYSEXIT uses the two entries after those: the same layout as our GDT.
+    // Family 6 models before 3 report SEP without actually having it.
+    if(cpu->index == 0) {
+        u32 eax, edx;
+        CPU_CPUID(1, &eax, NULL, NULL, &edx);
+        u32 family = (eax >> 8) & 0xF;
+        u32 model = (eax >> 4) & 0xF;
+        u32 stepping = eax & 0xF;
+        gbHaveSysenter = (edx & CPUID_FEAT_EDX_SEP) && !(family == 6 && model < 3 && stepping < 3);
+        if(gbHaveSysenter) {
+            logprintf("interrupts: SYSENTER available\n");
+        }
+    }
+    if(gbHaveSysenter) {
+        CPU_WriteMSR(MSR_SYSENTER_CS, 0x08, 0);
+        CPU_WriteMSR(MSR_SYSENTER_ESP, 0, 0);
+        CPU_WriteMSR(MSR_SYSENTER_EIP, (u32)Sysenter_Entry, 0);
+    }
+}
+
+void TSS_SetKernelStack(u32 esp0) {
+    gaTSS[SMP_This()->index].esp0 = esp0;
+    if(gbHaveSysenter) {
+        CPU_WriteMSR(MSR_SYSENTER_ESP, esp0, 0);
+    }
+}
+
+static bool FromUserMode(const Registers* regs) {
+    return (regs->cs & 3) == 3;
 }
 
 static void GeneralProtectionFault(Registers* regs) {
@@ -291,6 +368,26 @@ static void GeneralProtectionFault(Registers* regs) {
     logprintf("EIP: %x CS: %x EFLAGS: %x SS: %x\n", regs->eip, regs->cs, regs->eflags, regs->ss);
     logprintf("======================\n");
 
+    if(FromUserMode(regs)) {
+        Exec_Exit(EXEC_ERR_FAULT);
+    }
+    while(1) {
+        asm volatile("hlt");
+    }
+}
+
+// Any other CPU exception: the program is at fault, the kernel is broken
+static void CPUException(Registers* regs) {
+    logprintf("======================\n");
+    logprintf("CPU EXCEPTION %d ERR: %x\n", regs->int_no, regs->err_code);
+    logprintf("EAX: %x EBX: %x ECX: %x EDX: %x\n", regs->eax, regs->ebx, regs->ecx, regs->edx);
+    logprintf("ESI: %x EDI: %x EBP: %x ESP: %x\n", regs->esi, regs->edi, regs->ebp, regs->esp);
+    logprintf("EIP: %x CS: %x EFLAGS: %x SS: %x\n", regs->eip, regs->cs, regs->eflags, regs->ss);
+    logprintf("======================\n");
+
+    if(FromUserMode(regs)) {
+        Exec_Exit(EXEC_ERR_FAULT);
+    }
     while(1) {
         asm volatile("hlt");
     }
@@ -306,8 +403,9 @@ static void PageFault(Registers* regs) {
     bool R = regs->err_code & 8;
     bool I = regs->err_code & 16;
 
-    //if(!MM_MapToPhysical(NULL, (void*)addr) || P) {
-    if(1) {
+    // Faults on reserved areas are resolved by allocating a frame, or by
+    // copying a shared one
+    if(!MM_HandlePageFault((void*)addr, P, W)) {
         logprintf("======================\n");
         logprintf("PAGE FAULT\n");
         logprintf("EAX: %x EBX: %x ECX: %x EDX: %x\n", regs->eax, regs->ebx, regs->ecx, regs->edx);
@@ -317,49 +415,96 @@ static void PageFault(Registers* regs) {
         MM_PrintDiagnostic((void*)addr);
         logprintf("======================\n");
 
+        // A broken program only takes itself down
+        if(U) {
+            Exec_Exit(EXEC_ERR_FAULT);
+        }
         while(1) {
             asm volatile("hlt");
         }
     }
-    // TODO: check if we were in kernel or user mode when we implement user mode
 }
 
-struct Syscall_Handler {
-    u32 id;
-    void(*func)(Registers* regs);
-};
-
-#define MAX_SYSCALLS (128)
+static Interrupt_Handler gaSyscallHandlers[MAX_SYSCALLS];
 
-static Syscall_Handler gaSyscallHandlers[MAX_SYSCALLS];
-static u32 giSyscallHandlersLastIndex = 0;
+void RegisterSyscallHandler(u32 id, Interrupt_Handler func) {
+    ASSERT(id < MAX_SYSCALLS);
+    ASSERT(!gaSyscallHandlers[id] || gaSyscallHandlers[id] == func);
+    gaSyscallHandlers[id] = func;
+}
 
-void RegisterSyscallHandler(u32 id, void(*func)(Registers* regs)) {
-    if(giSyscallHandlersLastIndex < MAX_SYSCALLS) {
-        auto& SCH = gaSyscallHandlers[giSyscallHandlersLastIndex];
-        SCH.id = id;
-        SCH.func = func;
-        giSyscallHandlersLastIndex++;
+// Copies a NUL-terminated string from the program, checking each page
+bool Syscall_CopyInString(char* dst, Syscall_UserPtr<const char> src, u32 size) {
+    u32 i = 0;
+    while(i < size) {
+        // A page at a time, the string may end right before an unmapped one
+        u32 addr = (u32)src.ptr + i;
+        u32 chunk = 4096 - (addr & 0xFFF);
+        if(chunk > size - i) {
+            chunk = size - i;
+        }
+        if(!MM_IsUserAccessible((const void*)addr, chunk)) {
+            return false;
+        }
+        for(u32 end = i + chunk; i < end; i++) {
+            dst[i] = src.ptr[i];
+            if(dst[i] == '\0') {
+                return true;
+            }
+        }
     }
+
+    return false;
 }
 
+// Both entries come in with interrupts disabled. Handlers run with them
+// enabled, so the CPU keeps serving IRQs and the thread can be preempted
+// while a system call waits for a device.
 static void SyscallHandler(Registers* regs) {
     auto id = regs->eax;
-    for(u32 i = 0; i < giSyscallHandlersLastIndex; i++) {
-        if(gaSyscallHandlers[i].id == id) {
-            gaSyscallHandlers[i].func(regs);
-            return;
-        }
+    if(id < MAX_SYSCALLS && gaSyscallHandlers[id]) {
+        asm volatile("sti" : : : "memory");
+        gaSyscallHandlers[id](regs);
+        asm volatile("cli" : : : "memory");
+        return;
     }
 
     logprintf("PROGRAM ERROR: invalid syscall or no handler: %x\n", id);
 }
 
+// Called by Sysenter_Entry with a frame laid out like the one of INT 0x80.
+// The program's stub leaves its return address, ECX and EDX on its stack and
+// passes the stack pointer in EBP, since SYSENTER saves neither EIP nor ESP
+// and SYSEXIT takes them in ECX and EDX.
+extern "C" void SysenterHandler(Registers* regs) {
+    auto frame = (const u32*)regs->useresp;
+    if(regs->useresp >= KERNEL_BASE - 3 * sizeof(u32) || !MM_IsUserAccessible(frame, 3 * sizeof(u32))) {
+        logprintf("PROGRAM ERROR: bad stack on SYSENTER: %x\n", regs->useresp);
+        Exec_Exit(EXEC_ERR_FAULT);
+    }
+    // From here on the frame says where the program resumes, past the
+    // return address, like the one of INT 0x80 does
+    regs->eip = frame[0];
+    regs->useresp += sizeof(u32);
+    regs->ecx = frame[1];
+    regs->edx = frame[2];
+
+    SyscallHandler(regs);
+
+    regs->edx = regs->eip;
+    regs->ecx = regs->useresp;
+}
+
 void Interrupts_Setup() {
-    GDT_Setup();
+    auto cpu = SMP_GetCPU(0);
+    GDT_Setup(cpu);
+    TSS_Setup(cpu);
     PIC_Setup();
     IDT_Setup();
 
+    for(u32 i = 0; i < 32; i++) {
+        handlers[i] = CPUException;
+    }
     handlers[13] = GeneralProtectionFault;
     handlers[14] = PageFault;
     handlers[0x80] = SyscallHandler;
@@ -367,6 +512,12 @@ void Interrupts_Setup() {
     asm volatile("sti");
 }
 
+void Interrupts_SetupCPU(CPU_Local* cpu) {
+    GDT_Setup(cpu);
+    TSS_Setup(cpu);
+    IDT_Init(&idtd);
+}
+
 void Interrupts_Register_Handler(u32 i, Interrupt_Handler handler) {
     handlers[i] = handler;
 }
@@ -378,12 +529,20 @@ extern "C" void ISRHandler(Registers regs) {
 }
 
 extern "C" void IRQHandler(Registers regs) {
+    Preempt_Disable();
     if(handlers[regs.int_no]) {
         handlers[regs.int_no](&regs);
     }
-    if(regs.int_no >= 40) {
-        outb(0xA0, 0x20);
+    if(APIC_IsEnabled()) {
+        APIC_EOI();
+    } else {
+        if(regs.int_no >= 40) {
+            outb(0xA0, 0x20);
+        }
+
+        outb(0x20, 0x20); // send EOI
     }
+    Preempt_Enable();
 
-    outb(0x20, 0x20); // send EOI
+    Sched_Preempt(&regs);
 }
@@ -27,10 +27,22 @@ struct Registers {
 
 using Interrupt_Handler = void(*)(Registers* regs);
 
+struct CPU_Local;
+
 void Interrupts_Setup();
+// Loads the descriptor tables on another CPU
+void Interrupts_SetupCPU(CPU_Local* cpu);
 void Interrupts_Register_Handler(u32 i, Interrupt_Handler handler);
-void RegisterSyscallHandler(u32 id, void(*func)(Registers* regs));
+// System call numbers index a table directly
+#define MAX_SYSCALLS (128)
+
+// See RegisterSyscall in syscalls.h for typed handlers
+void RegisterSyscallHandler(u32 id, Interrupt_Handler func);
+
+// Stack the CPU switches to when program code enters the kernel
+void TSS_SetKernelStack(u32 esp0);
 
+// Work on the IOAPIC instead once APIC_Init took over
 void PIC_Mask(int IRQ);
 void PIC_Unmask(int IRQ);
 
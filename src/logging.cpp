@@ -2,6 +2,7 @@
 #include "logging.h"
 #include "interrupts.h"
 #include "utils.h"
+#include "spinlock.h"
 
 #include <stdarg.h>
 
@@ -14,6 +15,8 @@ struct Log_Destination_Entry {
 #define LOG_DEST_ENTRY_MAXCOUNT (4)
 
 static Log_Destination_Entry gEntries[LOG_DEST_ENTRY_MAXCOUNT];
+// Keeps the lines of different CPUs apart
+static Spinlock gLogLock;
 
 void Log_Init() {
     for(int i = 0; i < LOG_DEST_ENTRY_MAXCOUNT; i++) {
@@ -167,6 +170,7 @@ void logprintf(const char* format, ...) {
     va_list ap;
     va_start(ap, format);
     int step = 0;
+    u32 flags = Spin_Lock(&gLogLock);
 
     while(*format) {
         char cur = *format;
@@ -205,5 +209,6 @@ void logprintf(const char* format, ...) {
         format += step;
     }
 
+    Spin_Unlock(&gLogLock, flags);
     va_end(ap);
 }
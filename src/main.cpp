@@ -15,6 +15,10 @@
 #include "vm.h"
 #include "pfalloc.h"
 #include "dev_fs.h"
+#include "dma.h"
+#include "sched.h"
+#include "apic.h"
+#include "smp.h"
 
 extern "C" void _init();
 extern "C" void _fini();
@@ -28,9 +32,10 @@ extern "C" void kmain(u32 magic, const MB2_Header* mb2) {
     CharDev_Init();
     PCVGA_Init();
     UART_Setup(PORT_COM1);
-    MM_Init(); // TODO: move this back to line 26
-
+    // Sets up the per-CPU area, which vm keeps its state in
     Interrupts_Setup();
+    MM_Init();
+
     Timer_Setup();
 
     logprintf("Hello World!\n");
@@ -41,6 +46,12 @@ extern "C" void kmain(u32 magic, const MB2_Header* mb2) {
         ASSERT(!"Didn't boot from a Multiboot2 bootloader");
     }
 
+    DMA_Init();
+    APIC_Init();
+    Sched_Init();
+    PFA_StartReclaimThread();
+    SMP_Init();
+
     PS2_Setup();
 
     // Run driver registration code
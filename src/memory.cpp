@@ -5,4 +5,426 @@
 #include "pfalloc.h"
 #include "vm.h"
 
-#define KERNEL_RESERVED (8 * 1024 * 1024)
\ No newline at end of file
+#define KERNEL_RESERVED (8 * 1024 * 1024)
+
+// The page frame allocator, the virtual memory manager, kmalloc, DMA
+// buffers and swap call into each other in every direction, so they share
+// a single lock
+Kernel_Lock gMemoryLock;
+
+// Slab allocator
+// Small allocations are served from 16 KiB slabs carved into objects of a
+// single size class. Every slab sits in its own naturally aligned slot of
+// the slab arena, so the slab header of an object is found by masking its
+// address. Anything bigger than the largest class gets whole pages.
+
+#define SLAB_MAGIC (0x51AB51AB)
+#define SLAB_SIZE (16384)
+#define SLAB_PAGES (SLAB_SIZE / 4096)
+#define SLAB_SLOTS ((KERNEL_SLAB_END - KERNEL_SLAB_BASE) / SLAB_SIZE)
+#define SLAB_HEADER_SIZE (32)
+#define SLAB_CLASS_COUNT (8)
+#define SLAB_MIN_SIZE (16)
+#define SLAB_MAX_SIZE (2048)
+#define SLAB_MAGAZINE_SIZE (16)
+
+struct Slab_Object {
+    Slab_Object* next;
+};
+
+struct Slab {
+    u32 magic;
+    u32 size_class;
+    u32 phys;
+    u32 used; // Objects handed out
+    Slab_Object* free;
+    Slab *prev, *next;
+    u32 reserved;
+};
+
+static_assert(sizeof(Slab) <= SLAB_HEADER_SIZE);
+
+struct Slab_Cache {
+    u32 object_size;
+    u32 objects_per_slab;
+    Slab* partial;
+    Slab* full;
+    Slab* empty; // One empty slab is kept around to avoid thrashing
+    // Recently freed objects, handed out again before touching the slabs
+    u32 magazine_count;
+    void* magazine[SLAB_MAGAZINE_SIZE];
+};
+
+static Slab_Cache gaSlabCaches[SLAB_CLASS_COUNT];
+static u32 gaSlabSlots[SLAB_SLOTS / 32]; // Bitmap of used arena slots
+static u32 giSlabSlotHint;
+static u32 giSlabCount;
+static u32 giSlabBytesUsed; // Size of the objects handed out
+static bool gbSlabShrinkerRegistered;
+
+static u32 ShrinkSlabs(void* user, u32 target_frames);
+
+static u32 SizeClassOf(u32 size) {
+    u32 cls = 0;
+    while(((u32)SLAB_MIN_SIZE << cls) < size) {
+        cls++;
+    }
+    return cls;
+}
+
+static void SlabListPush(Slab** list, Slab* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if(slab->next) {
+        slab->next->prev = slab;
+    }
+    *list = slab;
+}
+
+static void SlabListRemove(Slab** list, Slab* slab) {
+    if(slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if(slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = slab->next = NULL;
+}
+
+static s32 AllocateSlabSlot() {
+    for(u32 i = 0; i < SLAB_SLOTS; i++) {
+        u32 slot = (giSlabSlotHint + i) % SLAB_SLOTS;
+        if((gaSlabSlots[slot / 32] & (1 << (slot % 32))) == 0) {
+            gaSlabSlots[slot / 32] |= (1 << (slot % 32));
+            giSlabSlotHint = slot + 1;
+            return (s32)slot;
+        }
+    }
+    return -1;
+}
+
+static void FreeSlabSlot(u32 slot) {
+    gaSlabSlots[slot / 32] &= ~(1 << (slot % 32));
+}
+
+static Slab* CreateSlab(u32 cls) {
+    auto& C = gaSlabCaches[cls];
+    Slab* ret = NULL;
+    u32 phys;
+
+    if(!gbSlabShrinkerRegistered) {
+        gbSlabShrinkerRegistered = PFA_RegisterShrinker(ShrinkSlabs, NULL);
+    }
+
+    s32 slot = AllocateSlabSlot();
+    if(slot == -1) {
+        logprintf("kmalloc: slab arena exhausted\n");
+        return NULL;
+    }
+
+    if(!PFA_Alloc(&phys, SLAB_SIZE)) {
+        FreeSlabSlot(slot);
+        return NULL;
+    }
+
+    auto base = (u8*)(KERNEL_SLAB_BASE + slot * SLAB_SIZE);
+    if(!MM_VirtualMapRange(base, phys, SLAB_PAGES)) {
+        PFA_Free(phys);
+        FreeSlabSlot(slot);
+        return NULL;
+    }
+
+    ret = (Slab*)base;
+    giSlabCount++;
+    ret->magic = SLAB_MAGIC;
+    ret->size_class = cls;
+    ret->phys = phys;
+    ret->used = 0;
+    ret->prev = ret->next = NULL;
+
+    // Thread the free list through the objects
+    ret->free = NULL;
+    for(u32 i = C.objects_per_slab; i > 0; i--) {
+        auto obj = (Slab_Object*)(base + SLAB_HEADER_SIZE + (i - 1) * C.object_size);
+        obj->next = ret->free;
+        ret->free = obj;
+    }
+
+    return ret;
+}
+
+static void DestroySlab(Slab* slab) {
+    u32 slot = ((u32)slab - KERNEL_SLAB_BASE) / SLAB_SIZE;
+    u32 phys = slab->phys;
+
+    slab->magic = 0;
+    giSlabCount--;
+    MM_VirtualUnmapRange(slab, SLAB_PAGES);
+    PFA_Free(phys);
+    FreeSlabSlot(slot);
+}
+
+static void* SlabAlloc(u32 cls) {
+    auto& C = gaSlabCaches[cls];
+
+    if(C.object_size == 0) {
+        C.object_size = SLAB_MIN_SIZE << cls;
+        C.objects_per_slab = (SLAB_SIZE - SLAB_HEADER_SIZE) / C.object_size;
+    }
+
+    if(C.magazine_count > 0) {
+        C.magazine_count--;
+        return C.magazine[C.magazine_count];
+    }
+
+    Slab* slab = C.partial;
+    if(!slab) {
+        if(C.empty) {
+            slab = C.empty;
+            C.empty = NULL;
+        } else {
+            slab = CreateSlab(cls);
+            if(!slab) {
+                return NULL;
+            }
+        }
+        SlabListPush(&C.partial, slab);
+    }
+
+    auto obj = slab->free;
+    slab->free = obj->next;
+    slab->used++;
+
+    if(slab->free == NULL) {
+        SlabListRemove(&C.partial, slab);
+        SlabListPush(&C.full, slab);
+    }
+
+    return obj;
+}
+
+// Puts an object back into its slab
+static void SlabRelease(Slab* slab, void* addr) {
+    auto& C = gaSlabCaches[slab->size_class];
+    auto obj = (Slab_Object*)addr;
+    bool was_full = slab->free == NULL;
+    obj->next = slab->free;
+    slab->free = obj;
+    slab->used--;
+
+    if(was_full) {
+        SlabListRemove(&C.full, slab);
+        SlabListPush(&C.partial, slab);
+    }
+
+    if(slab->used == 0) {
+        SlabListRemove(&C.partial, slab);
+        if(C.empty) {
+            DestroySlab(slab);
+        } else {
+            C.empty = slab;
+        }
+    }
+}
+
+static void SlabFree(Slab* slab, void* addr) {
+    ASSERT(slab->magic == SLAB_MAGIC);
+    auto& C = gaSlabCaches[slab->size_class];
+
+    if(C.magazine_count < SLAB_MAGAZINE_SIZE) {
+        C.magazine[C.magazine_count] = addr;
+        C.magazine_count++;
+        return;
+    }
+
+    SlabRelease(slab, addr);
+}
+
+// Called by pfalloc under memory pressure. Empties the magazines and
+// destroys the spare empty slab of each cache.
+static u32 ShrinkSlabs(void* user, u32 target_frames) {
+    KLock_Guard guard(&gMemoryLock);
+    (void)user;
+    u32 slabs_before = giSlabCount;
+
+    for(u32 cls = 0; cls < SLAB_CLASS_COUNT; cls++) {
+        if((slabs_before - giSlabCount) * SLAB_PAGES >= target_frames) {
+            break;
+        }
+
+        auto& C = gaSlabCaches[cls];
+        while(C.magazine_count > 0) {
+            C.magazine_count--;
+            void* addr = C.magazine[C.magazine_count];
+            SlabRelease((Slab*)((u32)addr & ~(SLAB_SIZE - 1)), addr);
+        }
+        if(C.empty) {
+            DestroySlab(C.empty);
+            C.empty = NULL;
+        }
+    }
+
+    return (slabs_before - giSlabCount) * SLAB_PAGES;
+}
+
+// Large allocations are built from single frames mapped into consecutive
+// pages of the vmalloc arena, so they never need contiguous physical memory.
+// Besides the used bitmap, the last page of every allocation is marked so
+// kfree can find out how long it is.
+
+#define VMALLOC_PAGES ((KERNEL_VMALLOC_END - KERNEL_VMALLOC_BASE) / 4096)
+
+static u32 gaVmallocUsed[VMALLOC_PAGES / 32];
+static u32 gaVmallocLast[VMALLOC_PAGES / 32];
+static u32 giVmallocHint;
+static u32 giVmallocPages;
+
+static bool VmallocTest(const u32* bitmap, u32 page) {
+    return (bitmap[page / 32] & (1 << (page % 32))) != 0;
+}
+
+static void VmallocSet(u32* bitmap, u32 page, bool value) {
+    if(value) {
+        bitmap[page / 32] |= (1 << (page % 32));
+    } else {
+        bitmap[page / 32] &= ~(1 << (page % 32));
+    }
+}
+
+static s32 FindVmallocRun(u32 page_count, u32 from) {
+    u32 run = 0;
+    for(u32 page = from; page < VMALLOC_PAGES; page++) {
+        if(VmallocTest(gaVmallocUsed, page)) {
+            run = 0;
+        } else {
+            run++;
+            if(run == page_count) {
+                return (s32)(page + 1 - page_count);
+            }
+        }
+    }
+    return -1;
+}
+
+static void VirtualFree(void* addr) {
+    u32 first = ((u32)addr - KERNEL_VMALLOC_BASE) / 4096;
+    u32 page = first;
+    bool last = false;
+
+    while(!last) {
+        u64 phys;
+        if(MM_MapToPhysical(&phys, (u8*)KERNEL_VMALLOC_BASE + page * 4096)) {
+            PFA_Free(phys);
+        }
+        last = VmallocTest(gaVmallocLast, page);
+        VmallocSet(gaVmallocUsed, page, false);
+        VmallocSet(gaVmallocLast, page, false);
+        page++;
+    }
+
+    // One TLB flush for the whole buffer
+    MM_VirtualUnmapRange(addr, page - first);
+    giVmallocPages -= page - first;
+}
+
+static void* VirtualAlloc(u32 page_count) {
+    s32 first = FindVmallocRun(page_count, giVmallocHint);
+    if(first == -1) {
+        first = FindVmallocRun(page_count, 0);
+    }
+    if(first == -1) {
+        logprintf("kmalloc: vmalloc arena exhausted\n");
+        return NULL;
+    }
+
+    for(u32 i = 0; i < page_count; i++) {
+        VmallocSet(gaVmallocUsed, first + i, true);
+    }
+    giVmallocPages += page_count;
+    VmallocSet(gaVmallocLast, first + page_count - 1, true);
+    giVmallocHint = first + page_count;
+
+    auto ret = (u8*)KERNEL_VMALLOC_BASE + first * 4096;
+
+    // Map runs of frames that happen to be adjacent in one go
+    u32 run_start = 0, run_phys = 0, run_len = 0;
+    for(u32 i = 0; i < page_count; i++) {
+        u32 phys;
+        if(!PFA_Alloc(&phys, 4096)) {
+            goto failed;
+        }
+        if(run_len > 0 && phys != run_phys + run_len * 4096) {
+            if(!MM_VirtualMapRange(ret + run_start * 4096, run_phys, run_len)) {
+                PFA_Free(phys);
+                goto failed;
+            }
+            run_len = 0;
+        }
+        if(run_len == 0) {
+            run_start = i;
+            run_phys = phys;
+        }
+        run_len++;
+    }
+    if(MM_VirtualMapRange(ret + run_start * 4096, run_phys, run_len)) {
+        return ret;
+    }
+
+failed:
+    // Frames of the pending run aren't mapped yet, VirtualFree takes care
+    // of the rest
+    MM_VirtualUnmapRange(ret + run_start * 4096, run_len);
+    for(u32 i = 0; i < run_len; i++) {
+        PFA_Free(run_phys + i * 4096);
+    }
+    VirtualFree(ret);
+    return NULL;
+}
+
+void* kmalloc(u32 size) {
+    KLock_Guard guard(&gMemoryLock);
+    void* ret = NULL;
+
+    ASSERT(size > 0);
+
+    if(size > 0) {
+        if(size <= SLAB_MAX_SIZE) {
+            u32 cls = SizeClassOf(size);
+            ret = SlabAlloc(cls);
+            if(ret) {
+                giSlabBytesUsed += SLAB_MIN_SIZE << cls;
+            }
+        } else {
+            ret = VirtualAlloc((size + 4095) / 4096);
+        }
+    }
+
+    return ret;
+}
+
+void kfree(void* addr) {
+    KLock_Guard guard(&gMemoryLock);
+    if(addr) {
+        u32 vaddr = (u32)addr;
+        if(KERNEL_SLAB_BASE <= vaddr && vaddr < KERNEL_SLAB_END) {
+            auto slab = (Slab*)(vaddr & ~(SLAB_SIZE - 1));
+            giSlabBytesUsed -= SLAB_MIN_SIZE << slab->size_class;
+            SlabFree(slab, addr);
+        } else if(KERNEL_VMALLOC_BASE <= vaddr && vaddr < KERNEL_VMALLOC_END) {
+            VirtualFree(addr);
+        } else {
+            ASSERT(!"kfree: not a kmalloc'd address");
+        }
+    }
+}
+
+void Mem_GetStats(Kmalloc_Stats* stats) {
+    KLock_Guard guard(&gMemoryLock);
+    ASSERT(stats);
+
+    stats->slab_bytes = giSlabCount * SLAB_SIZE;
+    stats->slab_used_bytes = giSlabBytesUsed;
+    stats->vmalloc_bytes = giVmallocPages * 4096;
+}
@@ -1,9 +1,22 @@
 #ifndef KERNEL_MEMORY_H
 #define KERNEL_MEMORY_H
 
+#include "spinlock.h"
+
+// Held by the public functions of pfalloc, vm, kmalloc, dma and swap
+extern Kernel_Lock gMemoryLock;
+
 void Mem_Init(void* base, u32 length);
 
 void* kmalloc(u32 size);
 void kfree(void* addr);
 
+struct Kmalloc_Stats {
+    u32 slab_bytes; // Memory held by slabs
+    u32 slab_used_bytes; // Part of it handed out
+    u32 vmalloc_bytes; // Large allocations
+};
+
+void Mem_GetStats(Kmalloc_Stats* stats);
+
 #endif /* KERNEL_MEMORY_H */
@@ -4,46 +4,85 @@
 #include "logging.h"
 #include "vm.h"
 #include "pfalloc.h"
+#include "cpu.h"
 
 #define NEXT_TAG_UNALIGNED(tag_hdr) (((u8*)(tag_hdr)) + tag_hdr->size)
 #define JUMP_NEXT_TAG(tag_hdr) tag_hdr = (const MB2_Tag_Header*)((u32)(NEXT_TAG_UNALIGNED(tag_hdr) + 7) & -8)
 
+#define NEXT_MEMMAP_ENTRY(mm, entry) ((const MB2_Tag_Memory_Map_Entry*)((u8*)(entry) + (mm)->entry_size))
+
+// PAE entries take physical addresses as wide as the CPU says, which is
+// 36 bits if it doesn't say
+static u64 PhysLimit() {
+    u32 max, bits = 36;
+    CPU_CPUID(0x80000000, &max, NULL, NULL, NULL);
+    if(max >= 0x80000008) {
+        CPU_CPUID(0x80000008, &bits, NULL, NULL, NULL);
+        bits &= 0xFF;
+    }
+    return 1ULL << bits;
+}
+
+// Clips an available range to the addressable part of physical memory;
+// returns false if nothing is left of it
+static bool ClipRange(const MB2_Tag_Memory_Map_Entry* entry, u64 limit, u64* addr, u64* len, u64* lost) {
+    u64 first = entry->base_addr;
+    u64 last = entry->base_addr + entry->length;
+
+    if(last > limit) {
+        u64 clipped = first < limit ? limit : first;
+        *lost += last - clipped;
+        last = clipped;
+    }
+    if(first >= last) {
+        return false;
+    }
+
+    *addr = first;
+    *len = last - first;
+    return true;
+}
+
 static void MB2_Parse_MemMap(const MB2_Tag_Memory_Map* mm) {
-    u32 addr_max = 0;
-    const MB2_Tag_Memory_Map_Entry* end = (MB2_Tag_Memory_Map_Entry*)((u8*)mm + mm->hdr.size);
+    u64 addr_max = 0;
+    u64 lost = 0;
+    u64 limit = PhysLimit();
+    auto end = (const MB2_Tag_Memory_Map_Entry*)((u8*)mm + mm->hdr.size);
     auto entry = (const MB2_Tag_Memory_Map_Entry*)(mm + 1);
 
     // Find maximum physical address
-    while(entry != end) {
-        if(entry->type == 1) {
-            u32 addr = (entry->base_addr & 0xFFFFFFFF);
-            u32 len = (entry->length & 0xFFFFFFFF);
-            auto end = addr + len;
-
-            if(end > addr_max) {
-                addr_max = end;
+    while(entry < end) {
+        u64 addr, len;
+        if(entry->type == 1 && ClipRange(entry, limit, &addr, &len, &lost)) {
+            if(addr + len > addr_max) {
+                addr_max = addr + len;
             }
         }
-        entry++;
+        entry = NEXT_MEMMAP_ENTRY(mm, entry);
+    }
+
+    if(lost > 0) {
+        logprintf("Ignoring %d MiB of memory the CPU can't address\n", (u32)(lost >> 20));
     }
 
     PFA_Init(addr_max);
 
     // Store free regions
     entry = (const MB2_Tag_Memory_Map_Entry*)(mm + 1);
+    lost = 0;
 
-    while(entry != end) {
-        if(entry->type == 1) {
-            u32 addr = (entry->base_addr & 0xFFFFFFFF);
-            u32 len = (entry->length & 0xFFFFFFFF);
-            logprintf("Memory section base=%x len=%x bytes\n", addr, len);
+    while(entry < end) {
+        u64 addr, len;
+        if(entry->type == 1 && ClipRange(entry, limit, &addr, &len, &lost)) {
+            logprintf("Memory section base=%x:%x len=%x:%x bytes\n", (u32)(addr >> 32), (u32)addr, (u32)(len >> 32), (u32)len);
 
             PFA_Init_InsertFree(addr, len);
         }
-        entry++;
+        entry = NEXT_MEMMAP_ENTRY(mm, entry);
     }
 
     PFA_PostInit();
+    MM_PostInit();
 }
 
 void MB2_Parse(const MB2_Header* hdr) {
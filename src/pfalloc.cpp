@@ -2,313 +2,1153 @@
 #include "pfalloc.h"
 #include "utils.h"
 #include "logging.h"
+#include "vm.h"
+#include "memory.h"
+#include "smp.h"
+#include "sched.h"
+#include "timer.h"
 
-enum Memory_Region_Type {
-    MRT_Unused = 0,
-    MRT_Unprocessed,
-    MRT_Free,
-    MRT_Kernel,
-    MRT_Program,
-    MRT_Last
+// Binary buddy allocator.
+// Every physical frame has a descriptor in gFrames. Free blocks of 2^order
+// frames are kept on per-order doubly linked lists threaded through the
+// descriptor of their first frame, so there is no cap on how fragmented
+// physical memory may become.
+// Frames from 4 GiB up have free lists of their own. The kernel addresses
+// physical memory with 32 bits in most places, so these only go to
+// PFA_AllocPage, whose callers put them into 64-bit page table entries.
+
+#define PFA_MAX_ORDER (10)
+#define PFA_ORDER_COUNT (PFA_MAX_ORDER + 1)
+
+#define PFN_NONE (0xFFFFFFFF)
+#define PFN(addr) ((u32)((u64)(addr) >> 12))
+#define PFN_ADDR(pfn) ((u64)(pfn) << 12)
+
+// First frame above 4 GiB
+#define PFN_HIGH (0x100000)
+
+enum Frame_Zone {
+    ZONE_LOW = 0,
+    ZONE_HIGH,
+    ZONE_COUNT,
 };
 
-struct Memory_Region {
-    constexpr Memory_Region() : type(MRT_Unused), addr_first(0), addr_last(0), prev(NULL), next(NULL), program_id(0) {}
-    Memory_Region_Type type;
-    u32 addr_first, addr_last;
-    Memory_Region *prev, *next;
-    u32 program_id;
+#define ZONE_OF(pfn) ((pfn) >= PFN_HIGH ? ZONE_HIGH : ZONE_LOW)
 
-    inline u32 size() const noexcept {
-        return addr_last - addr_first + 1;
-    }
+// Memory map entries we remember until PFA_PostInit
+#define PFA_BOOT_RANGES_MAX (32)
+
+// Zeroed frames kept ready for PFA_AllocZeroed
+#define PFA_ZERO_POOL_SIZE (64)
+
+// Programs that may own frames at the same time
+#define PFA_OWNERS_MAX (256)
+#define OWNER_NONE (0)
+
+// The reclaim thread trims the caches once fewer than PFA_LOW_WATERMARK
+// frames are free, until PFA_HIGH_WATERMARK are free again
+#define PFA_SHRINKERS_MAX (8)
+#define PFA_LOW_WATERMARK (128)
+#define PFA_HIGH_WATERMARK (256)
+#define PFA_RECLAIM_INTERVAL (100) // ticks
+
+// Background compaction keeps at least one block of this order free
+#define PFA_COMPACT_ORDER (4)
+// Candidate blocks checked before compaction gives up
+#define PFA_COMPACT_TRIES (8)
+
+enum Page_Frame_Type {
+    PFT_Reserved = 0,
+    PFT_Free,
+    PFT_Kernel,
+    PFT_Program,
+    PFT_Tail, // Part of a block, but not the first frame of it
+    PFT_Isolated, // Held back from the free lists while compaction runs
 };
 
-#define MEMORY_REGIONS_MAX (256)
-static Memory_Region gMemoryRegionPool[MEMORY_REGIONS_MAX];
-static Memory_Region *gMemoryRegions, *gMemoryRegionsLast;
+struct Page_Frame {
+    // Free list links, or owner list links of a program allocation
+    u32 next, prev;
+    // Number of frames in the free block or allocation headed by this frame
+    u16 count;
+    u16 refcount; // Users of the allocation headed by this frame
+    u16 owner; // Index into gaOwners + 1, or OWNER_NONE
+    u8 type;
+    u8 flags; // PFA_FLAG_*
+    // User address the program page is mapped at, so compaction can find its
+    // page table entry, or MAPPING_NONE
+    u32 mapping;
+};
+
+static_assert(sizeof(Page_Frame) == 20);
+
+#define MAPPING_NONE (0xFFFFFFFF)
+// Frame sits in the zero pool; `next` is its index there. Internal only.
+#define PFA_FLAG_ZERO_POOL (0x80)
+
+// The descriptor array ends where the slab arena begins, which caps the
+// memory we can use at about 50 GiB
+#define PFA_MAX_FRAMES ((KERNEL_SLAB_BASE - KERNEL_FRAMES_BASE) / sizeof(Page_Frame))
+
+struct Boot_Range {
+    u64 addr, len;
+};
+
+// Allocations made on behalf of a program are linked together, so all of
+// them can be freed without looking at anything else
+struct Frame_Owner {
+    u32 program_id; // 0 if the slot is unused
+    u32 head; // First allocation
+    u32 frames; // Resident frames
+};
+
+static Page_Frame* gFrames;
+static u32 giFrameCount;
+static u32 gaFreeLists[ZONE_COUNT][PFA_ORDER_COUNT];
+static u32 giFreeFrames;
+static u32 giHighFrames;
+static u32 giKernelFrames, giProgramFrames;
+
+static Frame_Owner gaOwners[PFA_OWNERS_MAX];
+
+static u32 gaZeroPool[PFA_ZERO_POOL_SIZE]; // PFNs
+static u32 giZeroPoolCount;
+
+struct Shrinker_Entry {
+    PFA_Shrinker shrinker;
+    void* user;
+    bool blocks; // Waits for devices, so never run with the lock held
+};
+
+static Shrinker_Entry gaShrinkers[PFA_SHRINKERS_MAX];
+// Set while shrinkers or compaction move frames around; neither starts
+// another pass meanwhile
+static bool gbReclaiming;
+static bool gbCompactionStuck; // Nothing to gain until frames get freed
+static bool gbReclaimStuck; // Same for the reclaim thread
+
+static Boot_Range gaBootRanges[PFA_BOOT_RANGES_MAX];
+static u32 giBootRangesCount;
+
+// Frames handed out while the descriptor array is being set up
+static u32 gBootstrapNext, gBootstrapEnd;
 
 // Symbols defined in linker.ld
 extern "C" u32 _kernel_start;
 extern "C" u32 _kernel_end;
 
-static Memory_Region* FindUnusedRegion() {
-    Memory_Region* ret = NULL;
-
-    for(int i = 0; i < MEMORY_REGIONS_MAX && ret == NULL; i++) {
-        auto& cur = gMemoryRegionPool[i];
-        if(cur.type == MRT_Unused) {
-            cur.type = MRT_Unprocessed;
-            ret = &cur;
+static void PFA_DebugPrint() {
+    logprintf("pfalloc: %d frames, %d free, %d above 4 GiB\n", giFrameCount, giFreeFrames, giHighFrames);
+    for(u32 zone = 0; zone < ZONE_COUNT; zone++) {
+        if(zone == ZONE_HIGH && giHighFrames == 0) {
+            break;
+        }
+        for(u32 order = 0; order < PFA_ORDER_COUNT; order++) {
+            u32 blocks = 0;
+            for(u32 pfn = gaFreeLists[zone][order]; pfn != PFN_NONE; pfn = gFrames[pfn].next) {
+                blocks++;
+            }
+            logprintf("\t%s order %d: %d free blocks\n", zone == ZONE_LOW ? "low" : "high", order, blocks);
         }
     }
+}
 
-    return ret;
+static void ListPush(u32 order, u32 pfn) {
+    auto& F = gFrames[pfn];
+    auto& head = gaFreeLists[ZONE_OF(pfn)][order];
+    F.prev = PFN_NONE;
+    F.next = head;
+    if(F.next != PFN_NONE) {
+        gFrames[F.next].prev = pfn;
+    }
+    head = pfn;
 }
 
-static void PFA_DebugPrint() {
-    auto cur = gMemoryRegions;
-    logprintf("Memory regions:\n");
-    while(cur) {
-        logprintf("\t(%d) %x -> %x\n", cur->type, cur->addr_first, cur->addr_last);
-        cur = cur->next;
-    }
-}
-
-// Tries inserting the region
-static void InsertRegion(const Memory_Region& region) {
-    bool inserted = false;
-
-    auto cur = gMemoryRegions;
-    ASSERT(gMemoryRegions);
-
-    while(cur) {
-        bool contains_head = cur->addr_first <= region.addr_first && region.addr_first < cur->addr_last;
-        //bool contains_tail = cur->addr_last >= region.addr_last;
-        bool contains_tail = cur->addr_first < region.addr_last && region.addr_last <= cur->addr_last;
-
-        ASSERT((contains_head && contains_tail) || (!contains_head && !contains_tail));
-
-        if(contains_head && contains_tail) {
-            bool first_addr_overlapped = cur->addr_first == region.addr_first;
-            bool last_addr_overlapped = cur->addr_last == region.addr_last;
-            if(first_addr_overlapped && last_addr_overlapped) {
-                // Replace cur region with arg region
-                cur->type = region.type;
-                inserted = true;
-            } else {
-                Memory_Region* new_region;
-                new_region = FindUnusedRegion();
-                new_region->addr_first = region.addr_first;
-                new_region->addr_last = region.addr_last;
-                new_region->type = region.type;
-
-                if(first_addr_overlapped) {
-                    // Argument and current regions' first addresses match
-                    // We must insert the new element between cur->prev and cur
-                    
-                    // Link cur->prev to new_region
-                    new_region->prev = cur->prev;
-                    if(new_region->prev) {
-                        new_region->prev->next = new_region;
-                    } else {
-                        // No previous region; update the region list head
-                        gMemoryRegions = new_region;
-                    }
+static void ListRemove(u32 order, u32 pfn) {
+    auto& F = gFrames[pfn];
+    if(F.prev != PFN_NONE) {
+        gFrames[F.prev].next = F.next;
+    } else {
+        gaFreeLists[ZONE_OF(pfn)][order] = F.next;
+    }
+    if(F.next != PFN_NONE) {
+        gFrames[F.next].prev = F.prev;
+    }
+    F.next = F.prev = PFN_NONE;
+}
 
-                    // Link new_region to cur
-                    cur->prev = new_region;
-                    new_region->next = cur;
-                    // Resize cur region
-                    cur->addr_first = region.addr_last + 1;
-                } else if(last_addr_overlapped) {
-                    // Argument and current regions' last addresses match
-                    // We must insert the new element between cur and cur->next
-
-                    // Link cur->next to new_region
-                    new_region->next = cur->next;
-                    if(new_region->next) {
-                        new_region->next->prev = new_region;
-                    } else {
-                        // No next subsequent region; update the region list tail
-                        gMemoryRegionsLast = new_region;
-                    }
-                    // Link cur to new_region
-                    cur->next = new_region;
-                    new_region->prev = cur;
-                    // Resize cur region
-                    cur->addr_last = region.addr_first - 1;
-                } else {
-                    auto cur_prev = cur->prev;
-                    auto cur_next = cur->next;
-                    auto pre = FindUnusedRegion();
-                    auto post = FindUnusedRegion();
-                    ASSERT(pre && post);
-                    ASSERT(pre != cur && cur != post);
-
-                    auto A = cur->addr_first;
-                    auto B = region.addr_first;
-                    auto C = region.addr_last;
-                    auto D = cur->addr_last;
-
-                    pre->prev = cur_prev;
-                    post->next = cur_next;
-                    cur->prev = pre; pre->next = cur;
-                    cur->next = post; post->prev = cur;
-                    if(cur_prev) cur_prev->next = pre;
-                    if(cur_next) cur_next->prev = post;
-
-                    pre->addr_first = A;
-                    pre->addr_last = B - 1;
-                    cur->addr_first = B;
-                    cur->addr_last = C;
-                    post->addr_first = C + 1;
-                    post->addr_last = D;
-                    pre->type = cur->type;
-                    post->type = cur->type;
-                    cur->type = region.type;
-
-                    if(cur == gMemoryRegions) {
-                        gMemoryRegions = pre;
-                    }
-                    if(cur == gMemoryRegionsLast) {
-                        gMemoryRegionsLast = post;
-                    }
-                }
-                inserted = true;
-            }
+// Puts a naturally aligned block back onto the free lists, merging it with
+// its buddy as long as the buddy is free too. Blocks are at most 4 MiB, so
+// they never straddle 4 GiB.
+static void FreeBlock(u32 pfn, u32 order) {
+    giFreeFrames += (1 << order);
+
+    while(order < PFA_MAX_ORDER) {
+        u32 buddy = pfn ^ (1 << order);
+        if(buddy >= giFrameCount) {
+            break;
+        }
+        auto& B = gFrames[buddy];
+        if(B.type != PFT_Free || B.count != (1u << order)) {
             break;
         }
 
-        cur = cur->next;
+        ListRemove(order, buddy);
+        B.type = PFT_Tail;
+        B.count = 0;
+        if(buddy < pfn) {
+            gFrames[pfn].type = PFT_Tail;
+            gFrames[pfn].count = 0;
+            pfn = buddy;
+        }
+        order++;
     }
 
-    if(!inserted) {
-        logprintf("Failed to insert region [%x, %x]\n", region.addr_first, region.addr_last);
-        PFA_DebugPrint();
-    }
+    auto& F = gFrames[pfn];
+    F.type = PFT_Free;
+    F.count = 1 << order;
+    ListPush(order, pfn);
+}
 
-    ASSERT(inserted);
+// Frees [pfn, pfn + count) by splitting it into the largest aligned blocks
+static void FreeFrames(u32 pfn, u32 count) {
+    while(count > 0) {
+        u32 order = 0;
+        while(order < PFA_MAX_ORDER &&
+              (pfn & ((2u << order) - 1)) == 0 &&
+              (2u << order) <= count) {
+            order++;
+        }
+        FreeBlock(pfn, order);
+        pfn += (1 << order);
+        count -= (1 << order);
+    }
 }
 
-static void TryMergingFreeRegions(Memory_Region* region) {
-    ASSERT(region->type == MRT_Free);
-    if(region->prev && region->prev->type == MRT_Free) {
-        auto prev = region->prev;
-        prev->addr_last = region->addr_last;
-        region->type = MRT_Unused;
-        prev->next = region->next;
-        if(region->next) {
-            region->next->prev = prev;
+// Returns the owner slot of the program, or -1
+static s32 FindOwner(u32 program_id, bool create) {
+    s32 unused = -1;
+    for(u32 i = 0; i < PFA_OWNERS_MAX; i++) {
+        if(gaOwners[i].program_id == program_id) {
+            return (s32)i;
         }
-        region->prev = region->next = NULL;
-        // Recurse
-        TryMergingFreeRegions(prev);
-    } else if(region->next && region->next->type == MRT_Free) {
-        auto next = region->next;
-        next->addr_first = region->addr_first;
-        region->type = MRT_Unused;
-        next->prev = region->prev;
-        if(region->prev) {
-            region->prev->next = next;
+        if(unused == -1 && gaOwners[i].program_id == 0) {
+            unused = (s32)i;
         }
-        region->prev = region->next = NULL;
-        // Recurse
-        TryMergingFreeRegions(next);
     }
+    if(create && unused != -1) {
+        gaOwners[unused].program_id = program_id;
+        gaOwners[unused].head = PFN_NONE;
+        gaOwners[unused].frames = 0;
+        return unused;
+    }
+    return -1;
 }
 
-static void RemoveRegion(Memory_Region* region) {
-    region->type = MRT_Free;
-    TryMergingFreeRegions(region);
+static void OwnerLink(u32 slot, u32 pfn) {
+    auto& O = gaOwners[slot];
+    auto& F = gFrames[pfn];
+    F.owner = slot + 1;
+    F.prev = PFN_NONE;
+    F.next = O.head;
+    if(F.next != PFN_NONE) {
+        gFrames[F.next].prev = pfn;
+    }
+    O.head = pfn;
+    O.frames += F.count;
 }
 
-void PFA_Init_InsertFree(u32 addr, u32 len) {
-    Memory_Region region;
+static void OwnerUnlink(u32 pfn) {
+    auto& F = gFrames[pfn];
+    auto& O = gaOwners[F.owner - 1];
+    if(F.prev != PFN_NONE) {
+        gFrames[F.prev].next = F.next;
+    } else {
+        O.head = F.next;
+    }
+    if(F.next != PFN_NONE) {
+        gFrames[F.next].prev = F.prev;
+    }
+    O.frames -= F.count;
+    if(O.head == PFN_NONE) {
+        O.program_id = 0;
+    }
+    F.next = F.prev = PFN_NONE;
+    F.owner = OWNER_NONE;
+}
 
-    ASSERT(len > 0);
+static u32 OrderOf(u32 count) {
+    u32 order = 0;
+    while((1u << order) < count) {
+        order++;
+    }
+    return order;
+}
 
-    region.type = MRT_Free;
-    region.addr_first = addr;
-    region.addr_last = addr + len - 1;
-    //region.next = region.prev = NULL;
+void PFA_Init_InsertFree(u64 addr, u64 len) {
+    ASSERT(len > 0);
 
-    InsertRegion(region);
+    if(giBootRangesCount < PFA_BOOT_RANGES_MAX) {
+        gaBootRanges[giBootRangesCount].addr = addr;
+        gaBootRanges[giBootRangesCount].len = len;
+        giBootRangesCount++;
+    } else {
+        logprintf("pfalloc: too many memory map entries, ignoring %d KiB at %d MiB\n", (u32)(len >> 10), (u32)(addr >> 20));
+    }
 }
 
-void PFA_Init(u32 last_physical_address) {
-    // Clear region descriptors
-    for(int i = 0; i < MEMORY_REGIONS_MAX; i++) {
-        gMemoryRegionPool[i].type = MRT_Unused;
-        gMemoryRegionPool[i].addr_first = 0;
-        gMemoryRegionPool[i].addr_last = 0;
-        gMemoryRegionPool[i].prev = NULL;
-        gMemoryRegionPool[i].next = NULL;
+void PFA_Init(u64 last_physical_address) {
+    gFrames = NULL;
+    giFrameCount = PFA_MAX_FRAMES;
+    if((last_physical_address >> 12) < PFA_MAX_FRAMES) {
+        giFrameCount = PFN(last_physical_address);
+    }
+    giFreeFrames = 0;
+    giHighFrames = 0;
+    giKernelFrames = giProgramFrames = 0;
+    giBootRangesCount = 0;
+    gBootstrapNext = gBootstrapEnd = 0;
+
+    for(u32 zone = 0; zone < ZONE_COUNT; zone++) {
+        for(u32 order = 0; order < PFA_ORDER_COUNT; order++) {
+            gaFreeLists[zone][order] = PFN_NONE;
+        }
+    }
+
+    for(u32 i = 0; i < PFA_OWNERS_MAX; i++) {
+        gaOwners[i].program_id = 0;
     }
+    giZeroPoolCount = 0;
 
-    // Mark entire physical address space as unprocessed
-    // MB2_Parse will tell us what free regions there are
-    gMemoryRegionPool[0].addr_last = last_physical_address - 1;
-    gMemoryRegionPool[0].type = MRT_Unprocessed;
+    logprintf("pfalloc: memory ends at %d MiB\n", (u32)(last_physical_address >> 20));
+    if(giFrameCount == PFA_MAX_FRAMES) {
+        logprintf("pfalloc: only the first %d MiB have frame descriptors\n", PFA_MAX_FRAMES / 256);
+    }
+}
 
-    gMemoryRegions = &gMemoryRegionPool[0];
-    gMemoryRegionsLast = &gMemoryRegionPool[0];
+// Returns true if the frame must never be handed out
+static bool IsReservedFrame(u32 pfn, u32 array_first, u32 array_last) {
+    u32 kernel_first = PFN((u32)(&_kernel_start) - 0xC0000000);
+    u32 kernel_last = PFN(((u32)(&_kernel_end) + 4095) - 0xC0000000);
 
-    logprintf("pfalloc: memory is [0x0, %x]\n", last_physical_address);
+    return
+        pfn == 0 || // Keep physical address 0 distinguishable from NULL
+        pfn == PFN(0xB8000) || // VGA framebuffer
+        pfn == PFN(SMP_TRAMPOLINE) || // Where the other CPUs start out
+        (kernel_first <= pfn && pfn < kernel_last) ||
+        (array_first <= pfn && pfn < array_last);
 }
 
 void PFA_PostInit() {
     // Called after the memory regions has been mapped
-    // Insert region containing the kernel image
-    Memory_Region kernel_image;
+    u32 array_size = (giFrameCount * sizeof(Page_Frame) + 4095) & 0xFFFFF000;
+    u32 array_pages = array_size / 4096;
+    // Page tables that may be needed to map the descriptor array, 512
+    // entries each
+    u32 table_pages = (array_pages + 511) / 512 + 1;
+    u32 kernel_end = ((u32)(&_kernel_end) + 4095 - 0xC0000000) & 0xFFFFF000;
+    u32 array_phys = 0;
+
+    // Find room for the descriptor array past the kernel image. It and its
+    // page tables come from the bootstrap allocator, which is 32-bit.
+    for(u32 i = 0; i < giBootRangesCount && array_phys == 0; i++) {
+        u64 first = (gaBootRanges[i].addr + 4095) & ~4095ULL;
+        u64 last = (gaBootRanges[i].addr + gaBootRanges[i].len) & ~4095ULL;
+        if(first < kernel_end) {
+            first = kernel_end;
+        }
+        if(last > 0xFFFFF000) {
+            last = 0xFFFFF000;
+        }
+        if(first < last && last - first >= array_size + table_pages * 4096) {
+            array_phys = (u32)first;
+        }
+    }
+
+    ASSERT(array_phys != 0);
+
+    // Page tables allocated while mapping the array come right after it
+    gBootstrapNext = array_phys + array_size;
+    gBootstrapEnd = gBootstrapNext + table_pages * 4096;
+
+    MM_VirtualMapRange((void*)KERNEL_FRAMES_BASE, array_phys, array_pages);
+
+    gFrames = (Page_Frame*)KERNEL_FRAMES_BASE;
+    memset(gFrames, 0, array_size);
+    for(u32 pfn = 0; pfn < giFrameCount; pfn++) {
+        gFrames[pfn].next = gFrames[pfn].prev = PFN_NONE;
+    }
+
+    u32 array_first = PFN(array_phys);
+    u32 array_last = PFN(gBootstrapNext + 4095);
+    gBootstrapNext = gBootstrapEnd = 0;
 
-    kernel_image.type = MRT_Kernel;
-    kernel_image.addr_first = (u32)(&_kernel_start) - 0xC0000000;
-    kernel_image.addr_last = ((u32)(&_kernel_end + 4095) & 0xFFFFF000) - 1 - 0xC0000000; // NOTE: check if 4095 is correct here
-    InsertRegion(kernel_image);
+    // Hand every usable frame over to the buddy allocator
+    for(u32 i = 0; i < giBootRangesCount; i++) {
+        u64 range_first = (gaBootRanges[i].addr + 4095) >> 12;
+        u64 range_last = (gaBootRanges[i].addr + gaBootRanges[i].len) >> 12;
+        if(range_last > giFrameCount) {
+            range_last = giFrameCount;
+        }
+        if(range_first >= range_last) {
+            continue;
+        }
+        u32 first = (u32)range_first;
+        u32 last = (u32)range_last;
 
-    // Insert region containing the VGA framebuffer
-    kernel_image.addr_first = 0xB8000;
-    kernel_image.addr_last = 0xB8FFF;
-    InsertRegion(kernel_image);
+        u32 run_start = first;
+        for(u32 pfn = first; pfn <= last; pfn++) {
+            if(pfn == last || IsReservedFrame(pfn, array_first, array_last)) {
+                if(run_start < pfn) {
+                    FreeFrames(run_start, pfn - run_start);
+                    if(pfn > PFN_HIGH) {
+                        giHighFrames += pfn - (run_start > PFN_HIGH ? run_start : PFN_HIGH);
+                    }
+                }
+                run_start = pfn + 1;
+            }
+        }
+    }
 
     PFA_DebugPrint();
 }
 
+// The first `order` sized part of the block found has to end at or below
+// `limit`; lists are only walked past their head when there's a limit
+static u32 FindFreeOrder(u32 zone, u32 order, u32 limit, u32* pfn) {
+    for(u32 cur = order; cur < PFA_ORDER_COUNT; cur++) {
+        for(u32 i = gaFreeLists[zone][cur]; i != PFN_NONE; i = gFrames[i].next) {
+            if(i + (1 << order) <= limit) {
+                *pfn = i;
+                return cur;
+            }
+        }
+    }
+    return PFA_ORDER_COUNT;
+}
+
+// Smallest free block of at least `order` ending below the `limit` PFN,
+// from above 4 GiB first if `high` is set
+static u32 FindFree(u32 order, bool high, u32 limit, u32* pfn) {
+    if(high) {
+        u32 cur = FindFreeOrder(ZONE_HIGH, order, limit, pfn);
+        if(cur < PFA_ORDER_COUNT) {
+            return cur;
+        }
+    }
+    return FindFreeOrder(ZONE_LOW, order, limit, pfn);
+}
+
+static u32 Reclaim(u32 target_frames, bool may_block);
+static bool Compact(u32 order);
+
+// Takes `count` contiguous frames below the `limit` PFN off the free lists;
+// returns the first one, or PFN_NONE
+static u32 AllocFrames(u32 program_id, u32 count, bool high, u32 limit = PFN_NONE) {
+    u32 order = OrderOf(count);
+    if(order > PFA_MAX_ORDER) {
+        logprintf("pfalloc: %d frames can't be allocated contiguously\n", count);
+        return PFN_NONE;
+    }
+
+    // Find the smallest free block that fits, squeezing the caches once
+    // if there is none
+    u32 pfn;
+    u32 cur = FindFree(order, high, limit, &pfn);
+    if(cur == PFA_ORDER_COUNT && Reclaim(1 << order, false) > 0) {
+        cur = FindFree(order, high, limit, &pfn);
+    }
+    // Enough frames may be free, just not next to each other
+    if(cur == PFA_ORDER_COUNT && order > 0 && Compact(order)) {
+        cur = FindFree(order, high, limit, &pfn);
+    }
+
+    if(cur == PFA_ORDER_COUNT) {
+        logprintf("pfalloc: out of memory\n");
+        return PFN_NONE;
+    }
+
+    // Only claim an owner slot once the frames are there
+    s32 owner = -1;
+    if(program_id != 0) {
+        owner = FindOwner(program_id, true);
+        if(owner == -1) {
+            logprintf("pfalloc: too many programs own memory\n");
+            return PFN_NONE;
+        }
+    }
+
+    ListRemove(cur, pfn);
+    giFreeFrames -= (1 << cur);
+
+    // Split the block until it's of the right order
+    while(cur > order) {
+        cur--;
+        u32 half = pfn + (1 << cur);
+        gFrames[half].type = PFT_Free;
+        gFrames[half].count = 1 << cur;
+        ListPush(cur, half);
+        giFreeFrames += (1 << cur);
+    }
+
+    auto& F = gFrames[pfn];
+    F.type = program_id == 0 ? PFT_Kernel : PFT_Program;
+    F.count = count;
+    F.refcount = 1;
+    F.flags = 0;
+    F.mapping = MAPPING_NONE;
+    if(owner != -1) {
+        OwnerLink(owner, pfn);
+    }
+    if(program_id == 0) {
+        giKernelFrames += count;
+    } else {
+        giProgramFrames += count;
+    }
+
+    // Give back the frames we don't need
+    if(count < (1u << order)) {
+        FreeFrames(pfn + count, (1 << order) - count);
+    }
+
+    return pfn;
+}
+
 bool PFA_Alloc(u32 *addr, u32 program_id, u32 size) {
+    KLock_Guard guard(&gMemoryLock);
     ASSERT(size > 0);
 
     *addr = NULL;
 
     if(size > 0) {
         ASSERT((size & 4095) == 0);
-        
-        Memory_Region region;
-        Memory_Region* candidate = NULL;
-        auto cur = gMemoryRegions;
-        while(cur) {
-            auto cur_size = cur->size();
-            if(cur->type == MRT_Free && cur_size >= size) {
-                if(!candidate || candidate->size() < cur->size()) {
-                    candidate = cur;
+
+        if(gFrames == NULL) {
+            // Still bootstrapping
+            if(gBootstrapNext + size <= gBootstrapEnd) {
+                *addr = gBootstrapNext;
+                gBootstrapNext += size;
+                return true;
+            }
+            logprintf("pfalloc: allocation before initialization\n");
+            return false;
+        }
+
+        u32 pfn = AllocFrames(program_id, size / 4096, false);
+        if(pfn == PFN_NONE) {
+            return false;
+        }
+        *addr = (u32)PFN_ADDR(pfn);
+    }
+
+    return true;
+}
+
+bool PFA_Alloc(u32 *addr, u32 size) {
+    return PFA_Alloc(addr, 0, size);
+}
+
+bool PFA_AllocBelow(u32* addr, u32 size, u32 max_phys) {
+    KLock_Guard guard(&gMemoryLock);
+    ASSERT(size > 0 && (size & 4095) == 0);
+
+    *addr = NULL;
+    if(gFrames == NULL) {
+        logprintf("pfalloc: allocation before initialization\n");
+        return false;
+    }
+
+    u32 pfn = AllocFrames(0, size / 4096, false, (u32)(((u64)max_phys + 1) >> 12));
+    if(pfn == PFN_NONE) {
+        return false;
+    }
+    *addr = (u32)PFN_ADDR(pfn);
+    return true;
+}
+
+bool PFA_AllocPage(u64* addr, u32 program_id) {
+    KLock_Guard guard(&gMemoryLock);
+    *addr = 0;
+
+    if(gFrames == NULL) {
+        u32 low;
+        if(!PFA_Alloc(&low, program_id, 4096)) {
+            return false;
+        }
+        *addr = low;
+        return true;
+    }
+
+    u32 pfn = AllocFrames(program_id, 1, true);
+    if(pfn == PFN_NONE) {
+        return false;
+    }
+    *addr = PFN_ADDR(pfn);
+    return true;
+}
+
+void PFA_Free(u64 addr) {
+    KLock_Guard guard(&gMemoryLock);
+    u32 pfn = PFN(addr);
+
+    if(gFrames && pfn < giFrameCount) {
+        auto& F = gFrames[pfn];
+        ASSERT(F.type == PFT_Kernel || F.type == PFT_Program);
+        if(F.type == PFT_Kernel || F.type == PFT_Program) {
+            ASSERT(F.refcount > 0);
+            F.refcount--;
+            if(F.refcount == 0) {
+                if(F.owner != OWNER_NONE) {
+                    OwnerUnlink(pfn);
+                }
+                u32 count = F.count;
+                if(F.type == PFT_Kernel) {
+                    giKernelFrames -= count;
+                } else {
+                    giProgramFrames -= count;
                 }
+                F.type = PFT_Tail;
+                F.count = 0;
+                F.flags = 0;
+                FreeFrames(pfn, count);
+                gbCompactionStuck = false;
+                gbReclaimStuck = false;
+            }
+        }
+    }
+}
+
+u32 PFA_GetSize(u64 addr) {
+    KLock_Guard guard(&gMemoryLock);
+    u32 ret = 0;
+    u32 pfn = PFN(addr);
+
+    if(gFrames && pfn < giFrameCount) {
+        auto& F = gFrames[pfn];
+        if(F.type == PFT_Kernel || F.type == PFT_Program) {
+            ret = (u32)F.count * 4096;
+        }
+    }
+
+    return ret;
+}
+
+void PFA_FreeAll(u32 program_id) {
+    KLock_Guard guard(&gMemoryLock);
+    if(gFrames && program_id != 0) {
+        s32 owner = FindOwner(program_id, false);
+        if(owner != -1) {
+            // Drop the program's reference to each of its allocations.
+            // Shared ones stay around, but no longer count as its memory.
+            // The slot is released together with the last allocation.
+            while(gaOwners[owner].program_id == program_id && gaOwners[owner].head != PFN_NONE) {
+                u32 pfn = gaOwners[owner].head;
+                OwnerUnlink(pfn);
+                PFA_Free(PFN_ADDR(pfn));
             }
-            cur = cur->next;
         }
+    }
+}
+
+static void ZeroPoolPush(u32 pfn) {
+    gaZeroPool[giZeroPoolCount] = pfn;
+    gFrames[pfn].next = giZeroPoolCount;
+    gFrames[pfn].flags |= PFA_FLAG_ZERO_POOL;
+    giZeroPoolCount++;
+}
+
+static void ZeroPoolRemove(u32 pfn) {
+    auto& F = gFrames[pfn];
+    ASSERT(F.flags & PFA_FLAG_ZERO_POOL);
+    giZeroPoolCount--;
+    u32 last = gaZeroPool[giZeroPoolCount];
+    gaZeroPool[F.next] = last;
+    gFrames[last].next = F.next;
+    F.next = PFN_NONE;
+    F.flags &= ~PFA_FLAG_ZERO_POOL;
+}
+
+// Clears a frame through a temporary kernel mapping. Frames for the pool
+// bypass the cache, ones handed out right away are wanted in it.
+static void ZeroFrame(u64 addr, bool background) {
+    auto page = MM_MapTemporary(addr);
+    if(background) {
+        SSE_ZeroPage(page);
+    } else {
+        void* dst = page;
+        u32 count = 4096 / 4;
+        asm volatile("rep stosl" : "+D"(dst), "+c"(count) : "a"(0) : "memory");
+    }
+    MM_UnmapTemporary(page);
+}
+
+bool PFA_AllocZeroed(u64* addr, u32 program_id) {
+    KLock_Guard guard(&gMemoryLock);
+    if(giZeroPoolCount > 0) {
+        u32 pfn = gaZeroPool[giZeroPoolCount - 1];
+        if(program_id != 0) {
+            s32 owner = FindOwner(program_id, true);
+            if(owner == -1) {
+                logprintf("pfalloc: too many programs own memory\n");
+                return false;
+            }
+            ZeroPoolRemove(pfn);
+            gFrames[pfn].type = PFT_Program;
+            OwnerLink(owner, pfn);
+            giKernelFrames--;
+            giProgramFrames++;
+        } else {
+            ZeroPoolRemove(pfn);
+        }
+        *addr = PFN_ADDR(pfn);
+        return true;
+    }
+
+    // Pool ran dry, clear one right now
+    if(!PFA_AllocPage(addr, program_id)) {
+        return false;
+    }
+    ZeroFrame(*addr, false);
+    return true;
+}
+
+static bool RefillZeroPool() {
+    // Leave some memory for everyone else
+    if(!gFrames || giZeroPoolCount == PFA_ZERO_POOL_SIZE || giFreeFrames < 4 * PFA_ZERO_POOL_SIZE) {
+        return false;
+    }
+
+    u64 addr;
+    if(!PFA_AllocPage(&addr)) {
+        return false;
+    }
+    ZeroFrame(addr, true);
+    ZeroPoolPush(PFN(addr));
+
+    return true;
+}
+
+// Background work for idle CPUs, skipped while anyone else allocates
+bool PFA_RefillZeroPool() {
+    if(!KLock_TryAcquire(&gMemoryLock)) {
+        return false;
+    }
+    bool ret = RefillZeroPool();
+    KLock_Release(&gMemoryLock);
+    return ret;
+}
+
+bool PFA_RegisterShrinker(PFA_Shrinker shrinker, void* user, bool blocks) {
+    KLock_Guard guard(&gMemoryLock);
+    ASSERT(shrinker);
+
+    for(u32 i = 0; i < PFA_SHRINKERS_MAX; i++) {
+        if(gaShrinkers[i].shrinker == NULL) {
+            gaShrinkers[i].shrinker = shrinker;
+            gaShrinkers[i].user = user;
+            gaShrinkers[i].blocks = blocks;
+            return true;
+        }
+    }
+
+    logprintf("pfalloc: too many shrinkers\n");
+    return false;
+}
+
+void PFA_UnregisterShrinker(PFA_Shrinker shrinker, void* user) {
+    KLock_Guard guard(&gMemoryLock);
+    for(u32 i = 0; i < PFA_SHRINKERS_MAX; i++) {
+        if(gaShrinkers[i].shrinker == shrinker && gaShrinkers[i].user == user) {
+            gaShrinkers[i].shrinker = NULL;
+            gaShrinkers[i].user = NULL;
+        }
+    }
+}
+
+// Allocations call this with the memory lock held by their caller, which
+// may be in the middle of changing a page table. Releasing it isn't safe
+// there, so shrinkers that block are left to the reclaim thread.
+static u32 Reclaim(u32 target_frames, bool may_block) {
+    Shrinker_Entry shrinkers[PFA_SHRINKERS_MAX];
+    u32 freed = 0;
+
+    KLock_Acquire(&gMemoryLock);
+    if(gbReclaiming || target_frames == 0) {
+        KLock_Release(&gMemoryLock);
+        return 0;
+    }
+    gbReclaiming = true;
+
+    // The zero pool is the cheapest to give up
+    while(giZeroPoolCount > 0 && freed < target_frames) {
+        u32 pfn = gaZeroPool[giZeroPoolCount - 1];
+        ZeroPoolRemove(pfn);
+        PFA_Free(PFN_ADDR(pfn));
+        freed++;
+    }
+    memcpy(shrinkers, gaShrinkers, sizeof(shrinkers));
+    KLock_Release(&gMemoryLock);
+
+    // Shrinkers take the memory lock themselves, others may allocate while
+    // the swap shrinker waits for the disk
+    bool skipped = false;
+    for(u32 i = 0; i < PFA_SHRINKERS_MAX && freed < target_frames; i++) {
+        if(shrinkers[i].shrinker && shrinkers[i].blocks && !may_block) {
+            skipped = true;
+        } else if(shrinkers[i].shrinker) {
+            freed += shrinkers[i].shrinker(shrinkers[i].user, target_frames - freed);
+        }
+    }
 
-        if(candidate) {
-            region.addr_first = candidate->addr_first;
-            region.addr_last = region.addr_first + size - 1;
-            region.program_id = program_id;
-            region.type = program_id == 0 ? MRT_Kernel : MRT_Program;
-            InsertRegion(region);
+    KLock_Acquire(&gMemoryLock);
+    gbReclaiming = false;
+    if(skipped) {
+        // Have the reclaim thread run them on its next pass
+        gbReclaimStuck = false;
+    }
+    KLock_Release(&gMemoryLock);
+    return freed;
+}
 
-            *addr = region.addr_first;
+u32 PFA_Reclaim(u32 target_frames) {
+    return Reclaim(target_frames, true);
+}
+
+// Trims the caches before memory actually runs out, so that allocations
+// don't have to wait for it
+static void ReclaimThread(void* arg) {
+    (void)arg;
+
+    while(true) {
+        KLock_Acquire(&gMemoryLock);
+        u32 free_frames = giFreeFrames;
+        bool trim = free_frames < PFA_LOW_WATERMARK && !gbReclaimStuck;
+        KLock_Release(&gMemoryLock);
+
+        if(trim && PFA_Reclaim(PFA_HIGH_WATERMARK - free_frames) == 0) {
+            KLock_Acquire(&gMemoryLock);
+            gbReclaimStuck = true;
+            KLock_Release(&gMemoryLock);
+        }
+        SleepTicks(PFA_RECLAIM_INTERVAL);
+    }
+}
+
+void PFA_StartReclaimThread() {
+    if(Thread_Create(ReclaimThread, NULL) == -1) {
+        logprintf("pfalloc: can't start the reclaim thread\n");
+    }
+}
+
+// Compaction
+// A multi-frame allocation can fail while plenty of frames are free, just
+// not next to each other. Compaction picks the aligned block that is the
+// cheapest to empty, moves the program pages in it elsewhere (vm fixes up
+// the page tables) and frees the block as a whole. Frames of the block are
+// isolated meanwhile, so the new homes of the pages are never inside it.
+
+// Single frame program pages can be moved as long as nothing but the
+// owner's page table points at them
+static bool IsMovable(u32 pfn) {
+    auto& F = gFrames[pfn];
+    return
+        F.type == PFT_Program && F.count == 1 && F.refcount == 1 &&
+        F.owner != OWNER_NONE && (F.flags & PFA_FLAG_PINNED) == 0;
+}
+
+// Number of pages that would have to move to empty the block at `first`,
+// or -1 if it can't be emptied
+static s32 CompactionCost(u32 first, u32 order) {
+    s32 cost = 0;
+    u32 pfn = first;
+
+    while(pfn < first + (1u << order)) {
+        auto& F = gFrames[pfn];
+        if(F.type == PFT_Free) {
+            pfn += F.count;
+            continue;
+        }
+        if(IsMovable(pfn)) {
+            cost++;
+        } else if(F.type != PFT_Kernel || (F.flags & PFA_FLAG_ZERO_POOL) == 0) {
+            return -1;
+        }
+        pfn++;
+    }
+
+    return cost;
+}
+
+static void Isolate(u32 pfn, u32 count) {
+    for(u32 i = pfn; i < pfn + count; i++) {
+        gFrames[i].type = PFT_Isolated;
+        gFrames[i].count = 0;
+        gFrames[i].refcount = 0;
+        gFrames[i].flags = 0;
+    }
+}
+
+// Empties the block at `first`; returns false if some page couldn't be moved
+static bool EvacuateBlock(u32 first, u32 order) {
+    u32 last = first + (1u << order);
+
+    // Take the free parts off the lists before anything gets allocated
+    u32 pfn = first;
+    while(pfn < last) {
+        auto& F = gFrames[pfn];
+        if(F.type == PFT_Free) {
+            u32 count = F.count;
+            ListRemove(OrderOf(count), pfn);
+            giFreeFrames -= count;
+            Isolate(pfn, count);
+            pfn += count;
         } else {
-            logprintf("pfalloc: out of memory\n");
+            if(F.type == PFT_Kernel) {
+                // Zeroed frames are just dropped from the pool
+                ZeroPoolRemove(pfn);
+                giKernelFrames--;
+                Isolate(pfn, 1);
+            }
+            pfn++;
+        }
+    }
+
+    for(pfn = first; pfn < last; pfn++) {
+        auto& F = gFrames[pfn];
+        if(F.type == PFT_Isolated) {
+            continue;
+        }
+
+        u32 program_id = gaOwners[F.owner - 1].program_id;
+        u64 dest;
+        if(!PFA_AllocPage(&dest, program_id)) {
+            return false;
+        }
+        if(!MM_MigrateFrame(program_id, PFN_ADDR(pfn), dest)) {
+            PFA_Free(dest);
             return false;
         }
+        OwnerUnlink(pfn);
+        giProgramFrames--;
+        Isolate(pfn, 1);
     }
 
     return true;
 }
 
-bool PFA_Alloc(u32 *addr, u32 size) {
-    return PFA_Alloc(addr, 0, size);
+// Releases the isolated frames of the block
+static void ReleaseBlock(u32 first, u32 order) {
+    for(u32 pfn = first; pfn < first + (1u << order); pfn++) {
+        if(gFrames[pfn].type == PFT_Isolated) {
+            gFrames[pfn].type = PFT_Tail;
+            FreeFrames(pfn, 1);
+        }
+    }
 }
 
-void PFA_Free(u32 addr) {
-    u32 addr_u32 = (u32)addr;
-    auto cur = gMemoryRegions;
+// Whether vm can find every page of the block that has to move. Frames of
+// owners that aren't address spaces, or that no page table points at,
+// would make EvacuateBlock fail halfway.
+static bool CanEvacuate(u32 first, u32 order) {
+    for(u32 pfn = first; pfn < first + (1u << order); pfn++) {
+        auto& F = gFrames[pfn];
+        if(F.type == PFT_Free) {
+            pfn += F.count - 1;
+            continue;
+        }
+        if(IsMovable(pfn) && !MM_CanMigrateFrame(gaOwners[F.owner - 1].program_id, PFN_ADDR(pfn))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// The cheapest block at `order` that isn't in `rejected`, or -1. Only
+// PFA_Alloc needs contiguous frames, so blocks above 4 GiB don't count.
+static s32 FindCompactionBlock(u32 order, const u32* rejected, u32 rejected_count, s32* best_cost) {
+    u32 size = 1 << order;
+    u32 low_frames = giFrameCount < PFN_HIGH ? giFrameCount : PFN_HIGH;
+    s32 best = -1;
+
+    for(u32 first = 0; first + size <= low_frames && !(best != -1 && *best_cost == 0); first += size) {
+        bool skip = false;
+        for(u32 i = 0; i < rejected_count && !skip; i++) {
+            skip = rejected[i] == first;
+        }
+        if(skip) {
+            continue;
+        }
+
+        s32 cost = CompactionCost(first, order);
+        if(cost != -1 && (best == -1 || cost < *best_cost)) {
+            best = (s32)first;
+            *best_cost = cost;
+        }
+    }
 
-    while(cur) {
-        if(cur->addr_first == addr_u32) {
-            ASSERT(cur->type != MRT_Free);
-            RemoveRegion(cur);
+    return best;
+}
+
+static bool Compact(u32 order) {
+    u32 rejected[PFA_COMPACT_TRIES];
+    u32 rejected_count = 0;
+    s32 best = -1, best_cost = -1;
+
+    if(gbReclaiming) {
+        return false;
+    }
+
+    // Nothing may move before the whole block is known to be evacuable
+    while(rejected_count < PFA_COMPACT_TRIES) {
+        best = FindCompactionBlock(order, rejected, rejected_count, &best_cost);
+        if(best == -1 || CanEvacuate(best, order)) {
             break;
         }
-        cur = cur->next;
+        rejected[rejected_count++] = (u32)best;
+        best = -1;
+    }
+    if(best == -1) {
+        return false;
+    }
+
+    gbReclaiming = true;
+    bool ret = EvacuateBlock(best, order);
+    ReleaseBlock(best, order);
+    gbReclaiming = false;
+
+    if(ret) {
+        logprintf("pfalloc: compacted %d frames at %x, moved %d pages\n", 1 << order, (u32)PFN_ADDR(best), best_cost);
+    }
+
+    return ret;
+}
+
+bool PFA_Compact() {
+    if(!KLock_TryAcquire(&gMemoryLock)) {
+        return false;
+    }
+
+    bool ret = false;
+    u32 pfn;
+    if(gFrames && !gbCompactionStuck && FindFreeOrder(ZONE_LOW, PFA_COMPACT_ORDER, PFN_NONE, &pfn) == PFA_ORDER_COUNT) {
+        ret = Compact(PFA_COMPACT_ORDER);
+        gbCompactionStuck = !ret;
+    }
+
+    KLock_Release(&gMemoryLock);
+    return ret;
+}
+
+void PFA_GetStats(PFA_Stats* stats) {
+    KLock_Guard guard(&gMemoryLock);
+    ASSERT(stats);
+
+    stats->total_frames = giFrameCount;
+    stats->free_frames = giFreeFrames;
+    stats->high_frames = giHighFrames;
+    stats->kernel_frames = giKernelFrames;
+    stats->program_frames = giProgramFrames;
+    stats->zero_pool_frames = giZeroPoolCount;
+    stats->largest_free_frames = 0;
+    for(u32 order = PFA_ORDER_COUNT; order > 0 && stats->largest_free_frames == 0; order--) {
+        for(u32 zone = 0; zone < ZONE_COUNT; zone++) {
+            if(gaFreeLists[zone][order - 1] != PFN_NONE) {
+                stats->largest_free_frames = 1 << (order - 1);
+            }
+        }
+    }
+}
+
+// Returns the descriptor heading the allocation at addr, or NULL
+static Page_Frame* AllocationAt(u64 addr) {
+    u32 pfn = PFN(addr);
+
+    if(gFrames && pfn < giFrameCount) {
+        auto& F = gFrames[pfn];
+        if(F.type == PFT_Kernel || F.type == PFT_Program) {
+            return &F;
+        }
+    }
+
+    return NULL;
+}
+
+void PFA_Ref(u64 addr) {
+    KLock_Guard guard(&gMemoryLock);
+    auto F = AllocationAt(addr);
+    ASSERT(F && F->refcount < 0xFFFF);
+    if(F) {
+        // A shared allocation no longer belongs to a single program; every
+        // user drops its own reference with PFA_Free
+        if(F->owner != OWNER_NONE) {
+            OwnerUnlink(PFN(addr));
+        }
+        F->refcount++;
+    }
+}
+
+u32 PFA_GetRefCount(u64 addr) {
+    KLock_Guard guard(&gMemoryLock);
+    auto F = AllocationAt(addr);
+    return F ? F->refcount : 0;
+}
+
+u32 PFA_GetFlags(u64 addr) {
+    KLock_Guard guard(&gMemoryLock);
+    auto F = AllocationAt(addr);
+    return F ? F->flags : 0;
+}
+
+void PFA_SetFlags(u64 addr, u32 flags) {
+    KLock_Guard guard(&gMemoryLock);
+    auto F = AllocationAt(addr);
+    if(F) {
+        F->flags = flags;
     }
 }
 
-void PFA_FreeAll(u32 program_id);
+void PFA_SetMapping(u64 addr, void* vaddr) {
+    KLock_Guard guard(&gMemoryLock);
+    auto F = AllocationAt(addr);
+    if(F) {
+        F->mapping = (u32)vaddr;
+    }
+}
+
+bool PFA_GetMapping(u64 addr, void** vaddr) {
+    KLock_Guard guard(&gMemoryLock);
+    auto F = AllocationAt(addr);
+    if(!F || F->mapping == MAPPING_NONE) {
+        return false;
+    }
+    *vaddr = (void*)F->mapping;
+    return true;
+}
+
+u32 PFA_GetResident(u32 program_id) {
+    KLock_Guard guard(&gMemoryLock);
+    u32 ret = 0;
+
+    if(program_id != 0) {
+        s32 owner = FindOwner(program_id, false);
+        if(owner != -1) {
+            ret = gaOwners[owner].frames * 4096;
+        }
+    }
+
+    return ret;
+}
+
+u32 PFA_GetPrograms(u32* program_ids, u32 max) {
+    KLock_Guard guard(&gMemoryLock);
+    u32 ret = 0;
+
+    for(u32 i = 0; i < PFA_OWNERS_MAX && ret < max; i++) {
+        if(gaOwners[i].program_id != 0) {
+            program_ids[ret++] = gaOwners[i].program_id;
+        }
+    }
+
+    return ret;
+}
@@ -5,13 +5,77 @@
 
 #include "common.h"
 
-void PFA_Init(u32 last_physical_address);
-void PFA_Init_InsertFree(u32 addr, u32 len);
+void PFA_Init(u64 last_physical_address);
+void PFA_Init_InsertFree(u64 addr, u64 len);
 void PFA_PostInit();
 
+// Frame flags
+#define PFA_FLAG_PINNED (0x01) // Must stay at its physical address
+
+// Contiguous frames below 4 GiB, which the kernel can address with 32 bits
 bool PFA_Alloc(u32 *addr, u32 program_id, u32 size);
 bool PFA_Alloc(u32 *addr, u32 size);
-void PFA_Free(u32 addr);
+// Same as above, but the allocation ends at or below max_phys
+bool PFA_AllocBelow(u32* addr, u32 size, u32 max_phys);
+// A single frame, from above 4 GiB while there is memory there. Only page
+// tables refer to these, through 64-bit PAE entries.
+bool PFA_AllocPage(u64* addr, u32 program_id = 0);
+// Allocate a single frame filled with zeroes, from the pool if possible;
+// it may be above 4 GiB just like with PFA_AllocPage
+bool PFA_AllocZeroed(u64* addr, u32 program_id = 0);
+// Zero one more frame for the pool; returns false if there was nothing to do.
+// Meant to be called when the CPU would otherwise be idle.
+bool PFA_RefillZeroPool();
+// Moves program pages around so that a 64 KiB block is free again; returns
+// false if there was nothing to do. Meant to be called when idle.
+bool PFA_Compact();
+// Drops a reference to the allocation; it's freed with the last one
+void PFA_Free(u64 addr);
+// Takes another reference to the allocation starting at addr. Shared
+// allocations aren't owned by any program anymore.
+void PFA_Ref(u64 addr);
+u32 PFA_GetRefCount(u64 addr);
+u32 PFA_GetFlags(u64 addr);
+void PFA_SetFlags(u64 addr, u32 flags);
+// Reverse map of single frame program pages: the user address the frame
+// is mapped at, which compaction uses to find its page table entry
+void PFA_SetMapping(u64 addr, void* vaddr);
+bool PFA_GetMapping(u64 addr, void** vaddr);
+// Free every allocation made on behalf of program_id
 void PFA_FreeAll(u32 program_id);
+// Bytes currently allocated on behalf of program_id
+u32 PFA_GetResident(u32 program_id);
+// Stores up to max ids of programs that own memory; returns how many
+u32 PFA_GetPrograms(u32* program_ids, u32 max);
+struct PFA_Stats {
+    u32 total_frames;
+    u32 free_frames;
+    u32 high_frames; // Above 4 GiB, free or not
+    u32 kernel_frames; // Including the zero pool
+    u32 program_frames;
+    u32 zero_pool_frames;
+    u32 largest_free_frames; // Biggest contiguous block available
+};
+
+void PFA_GetStats(PFA_Stats* stats);
+
+// Memory pressure
+// A shrinker gives memory held by a cache back to the allocator and returns
+// how many frames it freed. It may be asked for more than it has, and must
+// not allocate frames itself. Shrinkers that wait for a device set `blocks`;
+// failing allocations skip them and leave them to the reclaim thread.
+typedef u32 (*PFA_Shrinker)(void* user, u32 target_frames);
+
+bool PFA_RegisterShrinker(PFA_Shrinker shrinker, void* user, bool blocks = false);
+void PFA_UnregisterShrinker(PFA_Shrinker shrinker, void* user);
+// Asks the caches for target_frames frames; returns how many were freed.
+// The caller must not hold the memory lock.
+u32 PFA_Reclaim(u32 target_frames);
+// Starts the thread that trims the caches while memory is low; needs the
+// scheduler
+void PFA_StartReclaimThread();
+
+// Size in bytes of the allocation starting at addr
+u32 PFA_GetSize(u64 addr);
 
 #endif /* KERNEL_PFALLOC_H */
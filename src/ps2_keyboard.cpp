@@ -8,6 +8,7 @@
 #include "ring_buffer.h"
 #include "timer.h"
 #include "dev_fs.h"
+#include "spinlock.h"
 
 #include "logging.h"
 
@@ -17,6 +18,7 @@ struct PS2_Keyboard {
     u32 dev;
     u8 flags;
     volatile bool ack, resend, echo;
+    Spinlock event_lock; // The IRQ handler fills event_buffer meanwhile
     Ring_Buffer<Keyboard_Event, MAX_BUFFERED_EVENTS> event_buffer;
     Ring_Buffer<char, 128> char_buffer;
 };
@@ -259,7 +261,9 @@ static void IRQHandler(Registers* regs) {
                 }
 
                 //logprintf("kbd: sc=%d flags=%x\n", ev.vk, ev.flags);
+                u32 flags = Spin_Lock(&kbd->event_lock);
                 kbd->event_buffer.push(ev);
+                Spin_Unlock(&kbd->event_lock, flags);
             } else {
                 //logprintf("kbd: cant map sequence\n");
             }
@@ -268,27 +272,29 @@ static void IRQHandler(Registers* regs) {
     }
 }
 
-static void SC_PollKbd(Registers* regs) {
-    ASSERT(regs->eax == SYSCALL_POLLKBD);
-    u32 kbd = regs->ecx;
-    Keyboard_Event* dst = (Keyboard_Event*)regs->edx;
-    regs->eax = 0;
-
+// The thunk checked dst
+static int SC_PollKbd(u32 kbd, Syscall_UserPtr<Keyboard_Event> dst) {
     if(kbd < 2 && gpKeyboards[kbd]) {
         auto state = gpKeyboards[kbd];
 
-        if(state->event_buffer.pop(dst)) {
-            regs->eax = 1;
+        // dst may fault, which must not happen with the lock held
+        Keyboard_Event ev;
+        u32 flags = Spin_Lock(&state->event_lock);
+        bool ret = state->event_buffer.pop(&ev);
+        Spin_Unlock(&state->event_lock, flags);
+        if(ret) {
+            *dst.ptr = ev;
+            return 1;
         }
-    } else {
     }
+    return 0;
 }
 
 static void RegisterSyscall() {
     if(!gbRegisteredSyscall) {
         gbRegisteredSyscall = true;
 
-        RegisterSyscallHandler(SYSCALL_POLLKBD, &SC_PollKbd);
+        RegisterSyscall<SC_PollKbd, SC_ECX, SC_EDX>(SYSCALL_POLLKBD);
     }
 }
 
@@ -374,7 +380,10 @@ static bool CHDEV_Recv(void* user, char* ch) {
     if(kbd->char_buffer.pop(ch)) {
         ret = true;
     } else {
-        if(kbd->event_buffer.pop(&ev)) {
+        u32 flags = Spin_Lock(&kbd->event_lock);
+        bool popped = kbd->event_buffer.pop(&ev);
+        Spin_Unlock(&kbd->event_lock, flags);
+        if(popped) {
             if((ev.flags & KBEV_RELEASED) && TranslateControlSequence(&kbd->char_buffer, ev)) {
                 if(kbd->char_buffer.pop(ch)) {
                     ret = true;
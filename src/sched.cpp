@@ -0,0 +1,596 @@
+#include "common.h"
+#include "sched.h"
+#include "utils.h"
+#include "logging.h"
+#include "memory.h"
+#include "timer.h"
+#include "vm.h"
+#include "pfalloc.h"
+#include "smp.h"
+#include "spinlock.h"
+
+// Round robin scheduler for kernel threads, with a run queue per CPU.
+// Every thread has its own kernel stack; a thread that isn't running keeps
+// its callee saved registers and flags on that stack, see sched.S.
+// A thread running a program enters the kernel on the stack it recorded
+// with Sched_SetKernelStack. A thread is preempted from the timer interrupt
+// once its time slice is used up, in program and kernel code alike, unless
+// it holds a spinlock or is in an interrupt handler; see Preempt_Disable.
+// Only the boot CPU gets the timer interrupt, it sends the other CPUs an
+// IPI when their slice ends.
+// A thread goes back on the queue of the CPU it ran on; CPUs that run out
+// of threads steal them from the others. Kernel data shared between CPUs is
+// guarded by the locks of its subsystem, see spinlock.h.
+
+#define SCHED_STACK_SIZE (16384)
+#define SCHED_SLICE_TICKS (10)
+
+enum Thread_State {
+    TS_Ready = 0,
+    TS_Running,
+    TS_Sleeping,
+    TS_Dead,
+};
+
+struct Thread {
+    u8 fpu[512]; // FXSAVE area, must be 16 byte aligned
+    u32 esp; // Saved stack pointer while not running
+    u32 id;
+    volatile u32 state;
+    u32 wake_tick;
+    u32 page_directory;
+    u32 kernel_stack; // Entry stack from user mode, 0 if it never goes there
+    u32 cpu; // Queue it goes back on
+    u32 preempt_count; // Saved while not running, see CPU_Local
+    volatile bool on_cpu; // Its stack is in use until the switch away is done
+    u8* stack; // NULL for the boot threads
+    Thread_Entry entry;
+    void* arg;
+    Thread* next; // All threads
+    Thread* run_next; // Run queue, or the list of dead threads
+};
+
+static_assert(__builtin_offsetof(Thread, fpu) == 0);
+
+// Scheduler state of a CPU; other CPUs only touch the run queue
+struct Sched_CPU {
+    Spinlock lock; // Guards the run queue
+    Thread *run_head, *run_tail;
+    Thread* current;
+    Thread* idle;
+    Thread* finish_prev; // Switched away from, see FinishSwitch
+    volatile u32 slice_left;
+    volatile bool need_resched;
+    volatile bool idle_waiting; // Halted, wants an IPI when work shows up
+};
+
+extern "C" void Sched_SwitchStacks(u32* old_esp, u32 new_esp); // sched.S
+
+static Sched_CPU gaSchedCPUs[SMP_MAX_CPUS];
+static Spinlock gThreadsLock; // Thread list, dead threads and sleep states
+static Thread* gThreads;
+static Thread* gDeadThreads; // Waiting for someone else to free their stacks
+static u32 giNextThreadId;
+
+// Only with interrupts disabled
+static Sched_CPU* ThisCPU() {
+    return &gaSchedCPUs[SMP_This()->index];
+}
+
+static Thread* CurrentThread() {
+    return SMP_LOCAL(thread);
+}
+
+static u32 SaveFlagsAndDisable() {
+    u32 ret;
+    asm volatile("pushf\npop %0\ncli" : "=r"(ret) : : "memory");
+    return ret;
+}
+
+static void RestoreFlags(u32 flags) {
+    asm volatile("push %0\npopf" : : "r"(flags) : "memory", "cc");
+}
+
+// Caller holds sc->lock
+static void RunQueuePush(Sched_CPU* sc, Thread* thread) {
+    thread->state = TS_Ready;
+    thread->run_next = NULL;
+    if(sc->run_tail) {
+        sc->run_tail->run_next = thread;
+    } else {
+        sc->run_head = thread;
+    }
+    sc->run_tail = thread;
+}
+
+static Thread* RunQueuePop(Sched_CPU* sc) {
+    auto ret = sc->run_head;
+    if(ret) {
+        sc->run_head = ret->run_next;
+        if(!sc->run_head) {
+            sc->run_tail = NULL;
+        }
+        ret->run_next = NULL;
+    }
+    return ret;
+}
+
+// Lets a halted CPU steal the work that just showed up
+static void KickIdleCPU() {
+    u32 self = SMP_This()->index;
+    for(u32 i = 0; i < SMP_GetCPUCount(); i++) {
+        if(i != self && gaSchedCPUs[i].idle_waiting) {
+            gaSchedCPUs[i].idle_waiting = false;
+            SMP_SendIPI(i);
+            return;
+        }
+    }
+}
+
+// Queues a thread on the CPU it last ran on
+static void MakeReady(Thread* thread) {
+    auto sc = &gaSchedCPUs[thread->cpu];
+    u32 flags = Spin_Lock(&sc->lock);
+    RunQueuePush(sc, thread);
+    Spin_Unlock(&sc->lock, flags);
+
+    if(thread->cpu != SMP_This()->index && sc->idle_waiting) {
+        sc->idle_waiting = false;
+        SMP_SendIPI(thread->cpu);
+    } else {
+        KickIdleCPU();
+    }
+}
+
+// Takes a thread off the queue of another CPU
+static Thread* Steal() {
+    u32 self = SMP_This()->index;
+    u32 count = SMP_GetCPUCount();
+    for(u32 i = 1; i < count; i++) {
+        auto sc = &gaSchedCPUs[(self + i) % count];
+        if(!sc->run_head) {
+            continue;
+        }
+        u32 flags = Spin_Lock(&sc->lock);
+        auto ret = RunQueuePop(sc);
+        Spin_Unlock(&sc->lock, flags);
+        if(ret) {
+            ret->cpu = self;
+            return ret;
+        }
+    }
+    return NULL;
+}
+
+static bool HaveReadyThreads() {
+    for(u32 i = 0; i < SMP_GetCPUCount(); i++) {
+        if(gaSchedCPUs[i].run_head) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Sleepers still on their CPU wait for the next tick
+static void WakeSleepers() {
+    u32 now = TicksElapsed();
+    u32 flags = Spin_Lock(&gThreadsLock);
+    for(auto thread = gThreads; thread; thread = thread->next) {
+        if(thread->state == TS_Sleeping && !thread->on_cpu && (s32)(now - thread->wake_tick) >= 0) {
+            MakeReady(thread);
+        }
+    }
+    Spin_Unlock(&gThreadsLock, flags);
+}
+
+// Frees the threads that exited and left their stacks
+static void ReapDeadThreads() {
+    Thread* reaped = NULL;
+
+    u32 flags = Spin_Lock(&gThreadsLock);
+    auto dead = &gDeadThreads;
+    while(*dead) {
+        auto thread = *dead;
+        if(thread->on_cpu) {
+            dead = &thread->run_next;
+            continue;
+        }
+        *dead = thread->run_next;
+
+        for(auto prev = &gThreads; *prev; prev = &(*prev)->next) {
+            if(*prev == thread) {
+                *prev = thread->next;
+                break;
+            }
+        }
+        thread->run_next = reaped;
+        reaped = thread;
+    }
+    Spin_Unlock(&gThreadsLock, flags);
+
+    // kfree may have to wait for the memory lock
+    while(reaped) {
+        auto thread = reaped;
+        reaped = thread->run_next;
+        if(thread->stack) {
+            kfree(thread->stack);
+        }
+        kfree(thread);
+    }
+}
+
+// Runs on the stack of the thread switched to. Only now the previous one can
+// go back on a queue, where another CPU might pick it up.
+static void FinishSwitch() {
+    auto sc = ThisCPU();
+    auto prev = sc->finish_prev;
+    sc->finish_prev = NULL;
+
+    bool requeue = prev->state == TS_Running && prev != sc->idle;
+    __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+    if(requeue) {
+        MakeReady(prev);
+    }
+}
+
+// Runs with interrupts disabled
+static void SwitchTo(Sched_CPU* sc, Thread* next) {
+    auto cpu = SMP_This();
+    auto prev = sc->current;
+
+    prev->page_directory = cpu->page_directory;
+    prev->preempt_count = cpu->preempt_count;
+    asm volatile("fxsave (%0)" : : "r"(prev->fpu) : "memory");
+
+    sc->current = next;
+    cpu->thread = next;
+    next->state = TS_Running;
+    next->on_cpu = true;
+    next->cpu = cpu->index;
+    cpu->preempt_count = next->preempt_count;
+    sc->slice_left = SCHED_SLICE_TICKS;
+    if(next->page_directory != cpu->page_directory) {
+        SwitchPageDirectory(next->page_directory);
+    }
+    if(next->kernel_stack) {
+        TSS_SetKernelStack(next->kernel_stack);
+    }
+
+    sc->finish_prev = prev;
+    Sched_SwitchStacks(&prev->esp, next->esp);
+
+    // Back on prev's stack, not necessarily on the same CPU
+    FinishSwitch();
+    asm volatile("fxrstor (%0)" : : "r"(ThisCPU()->current->fpu) : "memory");
+}
+
+// Picks the next thread to run. Runs with interrupts disabled.
+static void Schedule() {
+    auto sc = ThisCPU();
+    auto cur = sc->current;
+
+    sc->need_resched = false;
+
+    u32 flags = Spin_Lock(&sc->lock);
+    auto next = RunQueuePop(sc);
+    Spin_Unlock(&sc->lock, flags);
+    if(!next) {
+        next = Steal();
+    }
+    if(!next) {
+        if(cur->state == TS_Running) {
+            // Nobody else wants to run
+            sc->slice_left = SCHED_SLICE_TICKS;
+            return;
+        }
+        next = sc->idle;
+    }
+
+    if(next != cur) {
+        SwitchTo(sc, next);
+    } else {
+        cur->state = TS_Running;
+    }
+}
+
+// Halts until an interrupt arrives, unless there is something to run
+static void WaitForWork() {
+    auto sc = ThisCPU();
+
+    asm volatile("cli" : : : "memory");
+    sc->idle_waiting = true;
+    if(HaveReadyThreads()) {
+        asm volatile("sti" : : : "memory");
+    } else {
+        // STI takes effect after HLT, so no wakeup is lost in between
+        asm volatile("sti\nhlt" : : : "memory");
+    }
+    sc->idle_waiting = false;
+}
+
+// Runs when there's nothing else to do
+[[noreturn]] static void IdleLoop() {
+    while(true) {
+        ReapDeadThreads();
+        if(!PFA_RefillZeroPool() && !PFA_Compact()) {
+            WaitForWork();
+        }
+        Sched_Yield();
+    }
+}
+
+static void IdleThread(void* arg) {
+    (void)arg;
+    IdleLoop();
+}
+
+// First function of every new thread; Sched_SwitchStacks returns into it
+static void ThreadStart() {
+    FinishSwitch();
+    auto cur = ThisCPU()->current;
+    asm volatile("fxrstor (%0)" : : "r"(cur->fpu) : "memory");
+    asm volatile("sti");
+
+    cur->entry(cur->arg);
+    Thread_Exit();
+}
+
+static void InitThread(Thread* thread, Thread_Entry entry, void* arg) {
+    ASSERT(((u32)thread->fpu & 15) == 0);
+
+    thread->state = TS_Ready;
+    thread->wake_tick = 0;
+    thread->page_directory = MM_GetKernelPageDirectory();
+    thread->kernel_stack = 0;
+    thread->cpu = SMP_This()->index;
+    thread->preempt_count = 0;
+    thread->on_cpu = false;
+    thread->stack = NULL;
+    thread->entry = entry;
+    thread->arg = arg;
+    thread->run_next = NULL;
+}
+
+static void LinkThread(Thread* thread) {
+    u32 flags = Spin_Lock(&gThreadsLock);
+    thread->id = giNextThreadId++;
+    thread->next = gThreads;
+    gThreads = thread;
+    Spin_Unlock(&gThreadsLock, flags);
+}
+
+static Thread* NewThread(Thread_Entry entry, void* arg) {
+    auto thread = (Thread*)kmalloc(sizeof(Thread));
+    if(!thread) {
+        return NULL;
+    }
+    InitThread(thread, entry, arg);
+
+    thread->stack = (u8*)kmalloc(SCHED_STACK_SIZE);
+    if(!thread->stack) {
+        kfree(thread);
+        return NULL;
+    }
+
+    // What Sched_SwitchStacks pops: edi, esi, ebx, ebp, eflags and the
+    // return address. Interrupts stay disabled until ThreadStart.
+    auto sp = (u32*)(thread->stack + SCHED_STACK_SIZE);
+    *--sp = 0; // ThreadStart never returns
+    *--sp = (u32)ThreadStart;
+    *--sp = 0x002; // EFLAGS
+    *--sp = 0; // ebp
+    *--sp = 0; // ebx
+    *--sp = 0; // esi
+    *--sp = 0; // edi
+    thread->esp = (u32)sp;
+
+    // Start out with a sane FPU state
+    asm volatile("fxsave (%0)" : : "r"(thread->fpu) : "memory");
+
+    LinkThread(thread);
+    return thread;
+}
+
+// Turns the code running on this CPU into a thread
+static Thread* AdoptCurrent() {
+    auto thread = (Thread*)kmalloc(sizeof(Thread));
+    ASSERT(thread);
+    InitThread(thread, NULL, NULL);
+    thread->state = TS_Running;
+    thread->page_directory = SMP_This()->page_directory;
+    thread->on_cpu = true;
+    LinkThread(thread);
+    return thread;
+}
+
+void Sched_Init() {
+    auto boot = AdoptCurrent();
+    auto idle = NewThread(IdleThread, NULL);
+    ASSERT(idle);
+
+    u32 flags = SaveFlagsAndDisable();
+    auto sc = ThisCPU();
+    sc->idle = idle;
+    sc->current = boot;
+    SMP_This()->thread = boot;
+    sc->slice_left = SCHED_SLICE_TICKS;
+    RestoreFlags(flags);
+
+    logprintf("sched: initialized\n");
+}
+
+void Sched_InitCPU() {
+    auto idle = AdoptCurrent();
+
+    u32 flags = SaveFlagsAndDisable();
+    auto sc = ThisCPU();
+    sc->idle = idle;
+    sc->current = idle;
+    SMP_This()->thread = idle;
+    sc->slice_left = SCHED_SLICE_TICKS;
+    RestoreFlags(flags);
+}
+
+void Sched_Idle() {
+    ASSERT(ThisCPU()->current == ThisCPU()->idle);
+    asm volatile("sti");
+    IdleLoop();
+}
+
+s32 Thread_Create(Thread_Entry entry, void* arg) {
+    ASSERT(entry);
+
+    if(!CurrentThread()) {
+        return -1;
+    }
+
+    ReapDeadThreads();
+    auto thread = NewThread(entry, arg);
+    if(!thread) {
+        return -1;
+    }
+    // It may be gone as soon as it's queued
+    s32 id = (s32)thread->id;
+
+    u32 flags = SaveFlagsAndDisable();
+    MakeReady(thread);
+    RestoreFlags(flags);
+
+    return id;
+}
+
+void Thread_Exit() {
+    SaveFlagsAndDisable();
+
+    auto sc = ThisCPU();
+    auto cur = sc->current;
+    ASSERT(cur != sc->idle);
+
+    u32 flags = Spin_Lock(&gThreadsLock);
+    cur->state = TS_Dead;
+    cur->run_next = gDeadThreads;
+    gDeadThreads = cur;
+    Spin_Unlock(&gThreadsLock, flags);
+    Schedule();
+
+    ASSERT(!"Dead thread was scheduled");
+}
+
+u32 Thread_GetId() {
+    auto cur = CurrentThread();
+    return cur ? cur->id : 0;
+}
+
+void Sched_Yield() {
+    if(CurrentThread()) {
+        u32 flags = SaveFlagsAndDisable();
+        Schedule();
+        RestoreFlags(flags);
+    }
+}
+
+bool Sched_SleepUntil(u32 tick) {
+    auto cur = CurrentThread();
+    if(!cur) {
+        return false;
+    }
+
+    u32 flags = SaveFlagsAndDisable();
+    if((s32)(TicksElapsed() - tick) < 0) {
+        u32 lflags = Spin_Lock(&gThreadsLock);
+        cur->wake_tick = tick;
+        cur->state = TS_Sleeping;
+        Spin_Unlock(&gThreadsLock, lflags);
+        Schedule();
+    }
+    RestoreFlags(flags);
+
+    return true;
+}
+
+void Sched_SetKernelStack(u32 esp0) {
+    u32 flags = SaveFlagsAndDisable();
+    auto cur = ThisCPU()->current;
+    ASSERT(cur);
+    cur->kernel_stack = esp0;
+    TSS_SetKernelStack(esp0);
+    RestoreFlags(flags);
+}
+
+u32 Sched_GetKernelStack() {
+    auto cur = CurrentThread();
+    return cur ? cur->kernel_stack : 0;
+}
+
+void Sched_Tick() {
+    auto self = ThisCPU();
+    if(!self->current) {
+        return;
+    }
+
+    for(u32 i = 0; i < SMP_GetCPUCount(); i++) {
+        auto sc = &gaSchedCPUs[i];
+        if(!sc->current || sc->current == sc->idle) {
+            continue;
+        }
+        if(sc->slice_left > 0) {
+            sc->slice_left--;
+        }
+        if(sc->slice_left == 0) {
+            sc->need_resched = true;
+            // The other CPUs don't get timer interrupts
+            if(sc != self) {
+                SMP_SendIPI(i);
+            }
+        }
+    }
+
+    WakeSleepers();
+}
+
+void Sched_Preempt(const Registers* regs) {
+    (void)regs;
+    auto sc = ThisCPU();
+    if(sc->need_resched && sc->current && SMP_This()->preempt_count == 0) {
+        Schedule();
+    }
+}
+
+// The owner of a Kernel_Lock is the thread holding it, or the CPU before
+// it runs threads. Thread addresses are far above any CPU number.
+static u32 LockToken() {
+    auto thread = CurrentThread();
+    return thread ? (u32)thread : SMP_LOCAL(index) + 1;
+}
+
+bool KLock_TryAcquire(Kernel_Lock* lock) {
+    u32 token = LockToken();
+    if(lock->owner == token) {
+        lock->depth++;
+        return true;
+    }
+
+    u32 expected = 0;
+    if(__atomic_compare_exchange_n(&lock->owner, &expected, token, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        lock->depth = 1;
+        return true;
+    }
+    return false;
+}
+
+void KLock_Acquire(Kernel_Lock* lock) {
+    while(!KLock_TryAcquire(lock)) {
+        // The owner may be waiting for this CPU to flush its TLB, or may be
+        // queued on this CPU
+        SMP_Relax();
+        Sched_Yield();
+    }
+}
+
+void KLock_Release(Kernel_Lock* lock) {
+    ASSERT(lock->owner == LockToken() && lock->depth > 0);
+    lock->depth--;
+    if(lock->depth == 0) {
+        __atomic_store_n(&lock->owner, 0, __ATOMIC_RELEASE);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef KERNEL_SCHED_H
+#define KERNEL_SCHED_H
+
+// Kernel threads
+
+#include "common.h"
+#include "interrupts.h"
+
+using Thread_Entry = void (*)(void* arg);
+
+// Turns the caller into the first thread; needs kmalloc
+void Sched_Init();
+// Turns the caller into the idle thread of another CPU
+void Sched_InitCPU();
+// Runs the idle loop of this CPU for good
+[[noreturn]] void Sched_Idle();
+
+// Starts a new thread running entry(arg); returns its id or -1
+s32 Thread_Create(Thread_Entry entry, void* arg);
+// Ends the calling thread
+void Thread_Exit();
+u32 Thread_GetId();
+
+// Lets other threads run
+void Sched_Yield();
+// Blocks the calling thread until the tick count reaches `tick`; returns
+// false if the scheduler isn't running yet
+bool Sched_SleepUntil(u32 tick);
+
+// Kernel stack the calling thread enters on from user mode; it is loaded
+// again whenever the thread is switched to
+extern "C" void Sched_SetKernelStack(u32 esp0);
+u32 Sched_GetKernelStack();
+
+// Called on every timer tick, which only the boot CPU gets
+void Sched_Tick();
+// Called by the IRQ dispatcher once the interrupt is acknowledged; switches
+// to another thread if the interrupted one used up its time slice and has
+// preemption enabled
+void Sched_Preempt(const Registers* regs);
+
+#endif /* KERNEL_SCHED_H */
@@ -0,0 +1,219 @@
+#include "common.h"
+#include "smp.h"
+#include "apic.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "logging.h"
+#include "memory.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "utils.h"
+#include "vm.h"
+
+// The other processors (APs) listed in the MADT are started one by one with
+// INIT, SIPI, SIPI. They come up in the trampoline of smp.S, which enables
+// paging with the kernel directory and calls SMP_APEntry on a stack of their
+// own. From then on they only run threads; device interrupts and the timer
+// stay with the boot CPU.
+// A CPU asks the others to flush their TLBs by setting their
+// tlb_flush_pending flag and sending them an IPI. Whoever spins waiting
+// for something serves its own flag meanwhile, see SMP_Relax, so two CPUs
+// waiting on each other with interrupts disabled don't deadlock. The range
+// to flush is left in globals, one shootdown runs at a time.
+
+#define AP_STACK_SIZE (16384)
+#define AP_STARTUP_TIMEOUT (100) // ms
+
+// Filled in by the boot CPU for each AP; the layout is fixed by smp.S
+struct Trampoline_Data {
+    u32 cr3;
+    u32 cr4;
+    u32 stack;
+    u32 cpu;
+    u32 entry;
+    u32 efer; // Bits to set in EFER before paging is enabled
+};
+
+extern "C" u8 SMP_Trampoline[]; // smp.S
+extern "C" u8 SMP_TrampolineData[];
+extern "C" u8 SMP_TrampolineEnd[];
+
+static CPU_Local gaCPULocal[SMP_MAX_CPUS];
+static volatile u32 giCPUCount = 1;
+static Spinlock gShootdownLock;
+static u8* gpShootdownAddr;
+static u32 giShootdownCount; // 0 for everything
+
+CPU_Local* SMP_GetCPU(u32 index) {
+    ASSERT(index < SMP_MAX_CPUS);
+    auto cpu = &gaCPULocal[index];
+    cpu->self = cpu;
+    cpu->index = index;
+    return cpu;
+}
+
+u32 SMP_GetCPUCount() {
+    return giCPUCount;
+}
+
+void SMP_SendIPI(u32 cpu) {
+    ASSERT(cpu < giCPUCount);
+    APIC_SendIPI(gaCPULocal[cpu].apic_id, APIC_IPI_FIXED(SMP_IPI_VECTOR));
+}
+
+static void ServeShootdown(CPU_Local* cpu) {
+    if(cpu->tlb_flush_pending) {
+        if(giShootdownCount == 0) {
+            MM_FlushGlobalTLB();
+        }
+        for(u32 i = 0; i < giShootdownCount; i++) {
+            asm volatile("invlpg (%0)" : : "r"(gpShootdownAddr + i * 4096) : "memory");
+        }
+        __atomic_store_n(&cpu->tlb_flush_pending, false, __ATOMIC_RELEASE);
+    }
+}
+
+void SMP_Relax() {
+    ServeShootdown(SMP_This());
+    asm volatile("pause");
+}
+
+void SMP_ShootdownTLB(u32 pd, void* vaddr, u32 count) {
+    if(giCPUCount < 2) {
+        return;
+    }
+
+    u32 flags;
+    asm volatile("pushf\npop %0\ncli" : "=r"(flags) : : "memory");
+
+    // Another CPU may be shooting down already and waiting for this one
+    while(__atomic_exchange_n(&gShootdownLock.locked, 1, __ATOMIC_ACQUIRE)) {
+        SMP_Relax();
+    }
+    Preempt_Disable(); // Spin_Unlock enables it again
+
+    gpShootdownAddr = (u8*)vaddr;
+    giShootdownCount = count;
+
+    // The entries must be visible before looking at who has pd loaded;
+    // SwitchPageDirectory publishes the new one before loading it
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    u32 self = SMP_This()->index;
+    for(u32 i = 0; i < giCPUCount; i++) {
+        if(i != self && (pd == 0 || gaCPULocal[i].page_directory == pd)) {
+            gaCPULocal[i].tlb_flush_pending = true;
+            SMP_SendIPI(i);
+        }
+    }
+    for(u32 i = 0; i < giCPUCount; i++) {
+        while(gaCPULocal[i].tlb_flush_pending) {
+            asm volatile("pause");
+        }
+    }
+
+    Spin_Unlock(&gShootdownLock, flags);
+}
+
+// Whatever the IPI was for besides shootdowns, Sched_Preempt handles after
+// this returns
+static void IPIHandler(Registers* regs) {
+    (void)regs;
+    ServeShootdown(SMP_This());
+}
+
+// Called by the trampoline, on the AP's own stack
+extern "C" void SMP_APEntry(CPU_Local* cpu) {
+    SSE_Setup();
+    Interrupts_SetupCPU(cpu);
+    SwitchPageDirectory(MM_GetKernelPageDirectory());
+    APIC_InitCPU();
+    Sched_InitCPU();
+
+    cpu->online = true;
+    Sched_Idle();
+}
+
+// Sends INIT, SIPI, SIPI and waits for the CPU to check in
+static bool StartCPU(volatile Trampoline_Data* data, u32 apic_id) {
+    auto cpu = SMP_GetCPU(giCPUCount);
+    cpu->apic_id = apic_id;
+
+    auto stack = (u8*)kmalloc(AP_STACK_SIZE);
+    if(!stack) {
+        return false;
+    }
+
+    data->cr3 = MM_GetKernelPageDirectory();
+    data->cr4 = CPU_ReadCR4();
+    data->stack = (u32)(stack + AP_STACK_SIZE);
+    data->cpu = (u32)cpu;
+    data->entry = (u32)SMP_APEntry;
+    data->efer = MM_HasNoExecute() ? EFER_NXE : 0;
+
+    APIC_SendIPI(apic_id, APIC_IPI_INIT);
+    Sleep(10);
+    for(u32 attempt = 0; attempt < 2 && !cpu->online; attempt++) {
+        APIC_SendIPI(apic_id, APIC_IPI_STARTUP(SMP_TRAMPOLINE >> 12));
+        Sleep(1);
+    }
+
+    u32 deadline = TicksElapsed() + AP_STARTUP_TIMEOUT;
+    while(!cpu->online && (s32)(TicksElapsed() - deadline) < 0) {
+        Sleep(1);
+    }
+    if(!cpu->online) {
+        // It may still wake up later and use the stack, so it's not freed
+        logprintf("smp: CPU with APIC ID %d didn't start\n", apic_id);
+        return false;
+    }
+
+    giCPUCount++;
+    logprintf("smp: CPU %d (APIC ID %d) online\n", cpu->index, apic_id);
+    return true;
+}
+
+void SMP_Init() {
+    auto bsp = SMP_GetCPU(0);
+    bsp->apic_id = APIC_GetLocalID();
+    bsp->online = true;
+
+    Interrupts_Register_Handler(SMP_IPI_VECTOR, IPIHandler);
+
+    u8 apic_ids[SMP_MAX_CPUS];
+    u32 count = APIC_IsEnabled() ? APIC_GetCPUs(apic_ids, SMP_MAX_CPUS) : 0;
+    if(count < 2) {
+        logprintf("smp: single processor\n");
+        return;
+    }
+
+    // Right after enabling paging the trampoline still runs at its physical
+    // address, so it's identity mapped in the kernel directory meanwhile
+    u32 size = SMP_TrampolineEnd - SMP_Trampoline;
+    ASSERT(size <= 4096);
+    ASSERT(SMP_This()->page_directory == MM_GetKernelPageDirectory());
+    auto page = (u8*)MM_VirtualMapKernel(SMP_TRAMPOLINE);
+    if(!page) {
+        return;
+    }
+    if(!MM_VirtualMapRange((void*)SMP_TRAMPOLINE, SMP_TRAMPOLINE, 1, MM_MAP_EXEC)) {
+        MM_VirtualUnmapKernel(page);
+        return;
+    }
+    memcpy(page, SMP_Trampoline, size);
+    auto data = (volatile Trampoline_Data*)(page + (SMP_TrampolineData - SMP_Trampoline));
+
+    for(u32 i = 0; i < count && giCPUCount < SMP_MAX_CPUS; i++) {
+        if(apic_ids[i] != bsp->apic_id && !StartCPU(data, apic_ids[i])) {
+            break;
+        }
+    }
+
+    // MM_VirtualMapRange made a page table for it, which nothing else frees
+    MM_VirtualUnmap((void*)SMP_TRAMPOLINE);
+    MM_FreeEmptyPageTable((void*)SMP_TRAMPOLINE);
+    MM_VirtualUnmapKernel(page);
+
+    logprintf("smp: %d CPU(s) running\n", giCPUCount);
+}
@@ -0,0 +1,106 @@
+#ifndef KERNEL_SMP_H
+#define KERNEL_SMP_H
+
+// Multiprocessor support
+
+#include "common.h"
+#include "apic.h"
+
+#define SMP_MAX_CPUS (APIC_MAX_CPUS)
+
+// Wakes an idle CPU, preempts program code and carries TLB shootdowns
+#define SMP_IPI_VECTOR (0xF0)
+
+// Physical page the other CPUs start out in, in real mode. Kept free by
+// pfalloc; smp.S has its own copy.
+#define SMP_TRAMPOLINE (0x8000)
+
+struct Thread;
+struct Address_Space;
+
+// Per-CPU area. Every CPU's GDT has a segment based at its own area, which
+// the kernel keeps loaded in GS.
+struct CPU_Local {
+    CPU_Local* self; // %gs:0
+    u32 index;
+    u32 apic_id;
+    volatile bool online;
+
+    Thread* thread; // Running thread, see sched.cpp
+
+    // Directory loaded in CR3, see vm.cpp
+    u32 page_directory;
+    Address_Space* space;
+    u32 frame_owner;
+
+    volatile bool tlb_flush_pending;
+    // Slots of MM_MapTemporary in use
+    u32 temp_maps;
+
+    // Of the running thread, sched.cpp swaps it on every switch. The thread
+    // isn't preempted while it's not 0.
+    volatile u32 preempt_count;
+};
+
+// Selector of the per-CPU segment; GS holds another one before the GDT of
+// the CPU is set up
+#define SMP_SEL_PERCPU (0x30)
+
+// Kernel code can be preempted and continue on another CPU, so the result
+// is only good as long as preemption or interrupts are disabled
+inline CPU_Local* SMP_This() {
+    CPU_Local* ret;
+    asm volatile("mov %%gs:0, %0" : "=r"(ret));
+    return ret;
+}
+
+// Reads a field of this CPU's area in one instruction. Fields that sched.cpp
+// switches along with the thread, like page_directory, stay valid after it.
+template<typename T>
+inline T SMP_ReadLocal(u32 offset) {
+    static_assert(sizeof(T) == 4);
+    T ret;
+    asm volatile("mov %%gs:(%1), %0" : "=r"(ret) : "r"(offset));
+    return ret;
+}
+
+#define SMP_LOCAL(field) \
+    SMP_ReadLocal<decltype(CPU_Local::field)>(__builtin_offsetof(CPU_Local, field))
+
+inline bool SMP_HasLocal() {
+    u16 gs;
+    asm volatile("mov %%gs, %0" : "=r"(gs));
+    return gs == SMP_SEL_PERCPU;
+}
+
+// Nest; spinlocks and interrupt handlers use them. Early boot code runs
+// before there is anything to preempt.
+inline void Preempt_Disable() {
+    if(SMP_HasLocal()) {
+        asm volatile("incl %%gs:%c0" : : "i"(__builtin_offsetof(CPU_Local, preempt_count)) : "memory");
+    }
+}
+
+inline void Preempt_Enable() {
+    if(SMP_HasLocal()) {
+        asm volatile("decl %%gs:%c0" : : "i"(__builtin_offsetof(CPU_Local, preempt_count)) : "memory");
+    }
+}
+
+// Area of CPU `index`; index 0 is the boot CPU
+CPU_Local* SMP_GetCPU(u32 index);
+// Number of CPUs running; they are numbered from 0
+u32 SMP_GetCPUCount();
+
+// Starts the other processors the MADT lists; needs the scheduler
+void SMP_Init();
+
+void SMP_SendIPI(u32 cpu);
+// Flushes [vaddr, vaddr + count pages) from the TLBs of the other CPUs and
+// waits until they did; count 0 flushes everything. If pd isn't 0, only
+// CPUs that have that directory loaded are asked.
+void SMP_ShootdownTLB(u32 pd = 0, void* vaddr = NULL, u32 count = 0);
+// Called while busy waiting; serves requests of other CPUs
+void SMP_Relax();
+
+#endif /* KERNEL_SMP_H */
@@ -0,0 +1,61 @@
+#ifndef KERNEL_SPINLOCK_H
+#define KERNEL_SPINLOCK_H
+
+// Locks for data shared between CPUs
+
+#include "common.h"
+#include "smp.h"
+
+// Disables interrupts and preemption while held, so it can be taken from
+// interrupt handlers. Held only for short, non-blocking sections.
+struct Spinlock {
+    volatile u32 locked;
+};
+
+// Returns the caller's EFLAGS for Spin_Unlock
+inline u32 Spin_Lock(Spinlock* lock) {
+    u32 flags;
+    asm volatile("pushf\npop %0\ncli" : "=r"(flags) : : "memory");
+    while(__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        while(lock->locked) {
+            asm volatile("pause");
+        }
+    }
+    Preempt_Disable();
+    return flags;
+}
+
+inline void Spin_Unlock(Spinlock* lock, u32 flags) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+    Preempt_Enable();
+    asm volatile("push %0\npopf" : : "r"(flags) : "memory", "cc");
+}
+
+// Lock of a whole subsystem. The thread holding it may take it again, and
+// may sleep while holding it; threads waiting for it let others run.
+// Never taken from interrupt handlers. Implemented in sched.cpp.
+struct Kernel_Lock {
+    volatile u32 owner; // Thread token, 0 if free
+    u32 depth;
+};
+
+void KLock_Acquire(Kernel_Lock* lock);
+bool KLock_TryAcquire(Kernel_Lock* lock);
+void KLock_Release(Kernel_Lock* lock);
+
+// Holds a Kernel_Lock until the end of the scope
+struct KLock_Guard {
+    Kernel_Lock* lock;
+
+    explicit KLock_Guard(Kernel_Lock* l) : lock(l) {
+        KLock_Acquire(lock);
+    }
+    ~KLock_Guard() {
+        KLock_Release(lock);
+    }
+
+    KLock_Guard(const KLock_Guard&) = delete;
+    void operator=(const KLock_Guard&) = delete;
+};
+
+#endif /* KERNEL_SPINLOCK_H */
@@ -0,0 +1,192 @@
+#include "common.h"
+#include "swap.h"
+#include "disk.h"
+#include "logging.h"
+#include "utils.h"
+#include "memory.h"
+#include "pfalloc.h"
+#include "vm.h"
+
+// The swap partition is divided into page sized slots. Every slot has a
+// reference count, since a cloned address space shares the swapped out
+// pages of its parent just like resident ones. Page-out is driven by
+// pfalloc's shrinkers, page-in by the page fault handler.
+
+// Swap entries keep the slot number in the upper 20 bits of a page table entry
+#define SWAP_SLOTS_MAX (1 << 20)
+
+struct Swap_Device {
+    bool active;
+    u32 disk;
+    u32 offset; // First block of the partition
+    u32 blocks_per_page;
+    u32 slot_count;
+    u32 used_slots;
+    u32 hint; // Where the search for free slots resumes
+    u16* refs;
+};
+
+static Swap_Device gSwap;
+static u8* gpClusterBuffer;
+
+static u32 SwapShrinker(void* user, u32 target_frames) {
+    (void)user;
+    return MM_SwapOut(target_frames);
+}
+
+bool Swap_Register(u32 disk, u32 offset, u32 length) {
+    KLock_Guard guard(&gMemoryLock);
+    if(gSwap.active) {
+        logprintf("swap: already using disk #%d, ignoring another partition\n", gSwap.disk);
+        return false;
+    }
+
+    u32 block_size = Disk_BlockSize(disk);
+    if(block_size == 0 || block_size > 4096 || (4096 % block_size) != 0) {
+        logprintf("swap: unsupported block size %d\n", block_size);
+        return false;
+    }
+
+    u32 blocks_per_page = 4096 / block_size;
+    u32 slot_count = length / blocks_per_page;
+    if(slot_count > SWAP_SLOTS_MAX) {
+        slot_count = SWAP_SLOTS_MAX;
+    }
+    if(slot_count == 0) {
+        return false;
+    }
+
+    auto refs = (u16*)kmalloc(slot_count * sizeof(u16));
+    if(!refs) {
+        return false;
+    }
+    memset(refs, 0, slot_count * sizeof(u16));
+
+    gpClusterBuffer = (u8*)kmalloc(SWAP_CLUSTER_PAGES * 4096);
+    if(!gpClusterBuffer) {
+        kfree(refs);
+        return false;
+    }
+
+    if(!PFA_RegisterShrinker(SwapShrinker, NULL, true)) {
+        kfree(gpClusterBuffer);
+        gpClusterBuffer = NULL;
+        kfree(refs);
+        return false;
+    }
+
+    gSwap.disk = disk;
+    gSwap.offset = offset;
+    gSwap.blocks_per_page = blocks_per_page;
+    gSwap.slot_count = slot_count;
+    gSwap.used_slots = 0;
+    gSwap.hint = 0;
+    gSwap.refs = refs;
+    gSwap.active = true;
+
+    logprintf("swap: using disk #%d at %x, %d KiB\n", disk, offset, slot_count * 4);
+
+    return true;
+}
+
+bool Swap_IsAvailable() {
+    return gSwap.active;
+}
+
+static s32 FindFreeSlots(u32 count, u32 from) {
+    u32 run = 0;
+    for(u32 slot = from; slot < gSwap.slot_count; slot++) {
+        if(gSwap.refs[slot] != 0) {
+            run = 0;
+        } else {
+            run++;
+            if(run == count) {
+                return (s32)(slot + 1 - count);
+            }
+        }
+    }
+    return -1;
+}
+
+bool Swap_AllocSlots(u32* slot, u32 count) {
+    KLock_Guard guard(&gMemoryLock);
+    ASSERT(slot && count > 0);
+
+    if(!gSwap.active) {
+        return false;
+    }
+
+    s32 first = FindFreeSlots(count, gSwap.hint);
+    if(first == -1) {
+        first = FindFreeSlots(count, 0);
+    }
+    if(first == -1) {
+        return false;
+    }
+
+    for(u32 i = 0; i < count; i++) {
+        gSwap.refs[first + i] = 1;
+    }
+    gSwap.used_slots += count;
+    gSwap.hint = first + count;
+    *slot = first;
+
+    return true;
+}
+
+void Swap_Free(u32 slot) {
+    KLock_Guard guard(&gMemoryLock);
+    ASSERT(gSwap.active && slot < gSwap.slot_count);
+    ASSERT(gSwap.refs[slot] > 0);
+
+    gSwap.refs[slot]--;
+    if(gSwap.refs[slot] == 0) {
+        gSwap.used_slots--;
+    }
+}
+
+void Swap_Ref(u32 slot) {
+    KLock_Guard guard(&gMemoryLock);
+    ASSERT(gSwap.active && slot < gSwap.slot_count);
+    ASSERT(gSwap.refs[slot] > 0 && gSwap.refs[slot] < 0xFFFF);
+
+    gSwap.refs[slot]++;
+}
+
+bool Swap_Write(u32 slot, const void* buf, u32 count) {
+    ASSERT(gSwap.active && slot + count <= gSwap.slot_count);
+
+    u32 blocks = count * gSwap.blocks_per_page;
+    s32 res = Disk_Write_Blocks(gSwap.disk, buf, blocks, gSwap.offset + slot * gSwap.blocks_per_page);
+    if(res != (s32)blocks) {
+        logprintf("swap: write of slots %d..%d failed\n", slot, slot + count - 1);
+        return false;
+    }
+
+    return true;
+}
+
+bool Swap_Read(u32 slot, void* buf) {
+    ASSERT(gSwap.active && slot < gSwap.slot_count);
+
+    u32 blocks = gSwap.blocks_per_page;
+    s32 res = Disk_Read_Blocks(gSwap.disk, buf, blocks, gSwap.offset + slot * gSwap.blocks_per_page);
+    if(res != (s32)blocks) {
+        logprintf("swap: read of slot %d failed\n", slot);
+        return false;
+    }
+
+    return true;
+}
+
+u8* Swap_GetClusterBuffer() {
+    return gpClusterBuffer;
+}
+
+void Swap_GetStats(Swap_Stats* stats) {
+    KLock_Guard guard(&gMemoryLock);
+    ASSERT(stats);
+
+    stats->total_pages = gSwap.active ? gSwap.slot_count : 0;
+    stats->free_pages = gSwap.active ? gSwap.slot_count - gSwap.used_slots : 0;
+}
@@ -0,0 +1,40 @@
+#ifndef KERNEL_SWAP_H
+#define KERNEL_SWAP_H
+
+// Swap space for program pages
+
+#include "common.h"
+
+// Pages written out by a single disk request at most
+#define SWAP_CLUSTER_PAGES (16)
+
+// Claims `length` blocks of `disk` starting at `offset` as swap space.
+// Only the first partition registered is used.
+bool Swap_Register(u32 disk, u32 offset, u32 length);
+bool Swap_IsAvailable();
+
+// Reserve `count` consecutive slots of one page each; returns the first one
+bool Swap_AllocSlots(u32* slot, u32 count);
+// Drops a reference to a slot; it's reused after the last one
+void Swap_Free(u32 slot);
+// Takes another reference to a slot, for address spaces sharing the page
+void Swap_Ref(u32 slot);
+
+// Write `count` pages from `buf` to consecutive slots in one request.
+// The I/O functions don't take the memory lock, the disk driver serializes
+// requests; callers hold references to the slots.
+bool Swap_Write(u32 slot, const void* buf, u32 count);
+bool Swap_Read(u32 slot, void* buf);
+
+// Room for SWAP_CLUSTER_PAGES pages. It's set aside up front, since it's
+// needed exactly when memory is short.
+u8* Swap_GetClusterBuffer();
+
+struct Swap_Stats {
+    u32 total_pages;
+    u32 free_pages;
+};
+
+void Swap_GetStats(Swap_Stats* stats);
+
+#endif /* KERNEL_SWAP_H */
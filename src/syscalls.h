@@ -1,6 +1,10 @@
 #ifndef KERNEL_SYSCALLS_H
 #define KERNEL_SYSCALLS_H
 
+#include "common.h"
+#include "interrupts.h"
+#include "vm.h"
+
 #define SYSCALL_READ            (0x0000)
 // EBX=size ECX=count EDX=fd EDI=dst EAX<-bytes_read
 #define SYSCALL_WRITE           (0x0001)
@@ -15,6 +19,122 @@
 // EDX=fd EAX<-position
 
 #define SYSCALL_POLLKBD         (0x0008)
-// ECX=Keyboard #ID EDX=Keyboard_Event* EAX<-valid
+// ECX=Keyboard #ID EDX=Keyboard_Event* EAX<-valid, -1 on a bad pointer
+#define SYSCALL_EXIT            (0x0009)
+// EBX=exit code, doesn't return
+#define SYSCALL_FORK            (0x000A)
+// EAX<-thread id of the copy, 0 in the copy, -1 on failure
+
+// Besides INT 0x80, system calls can be made with SYSENTER where the CPU
+// has it. The caller pushes EDX, ECX and its return address, in this order,
+// and passes the stack pointer in EBP. It's resumed at the return address
+// with that popped off the stack; EBP, ECX and EDX are clobbered.
+
+// Longest path a program can pass, with the terminator
+#define SYSCALL_PATH_MAX (256)
+
+// Registers a system call argument can come from
+enum Syscall_Reg {
+    SC_EBX,
+    SC_ECX,
+    SC_EDX,
+    SC_ESI,
+    SC_EDI,
+};
+
+template<Syscall_Reg Reg>
+inline u32 Syscall_Arg(const Registers* regs) {
+    if constexpr(Reg == SC_EBX) return regs->ebx;
+    if constexpr(Reg == SC_ECX) return regs->ecx;
+    if constexpr(Reg == SC_EDX) return regs->edx;
+    if constexpr(Reg == SC_ESI) return regs->esi;
+    if constexpr(Reg == SC_EDI) return regs->edi;
+}
+
+template<typename T> struct Syscall_IsVoid { static constexpr bool value = false; };
+template<> struct Syscall_IsVoid<void> { static constexpr bool value = true; };
+template<> struct Syscall_IsVoid<const void> { static constexpr bool value = true; };
+
+template<typename T> struct Syscall_False { static constexpr bool value = false; };
+
+// Pointer into the calling program's address space. Handlers take these
+// instead of plain pointers, which the thunk refuses. It checks that one T
+// lies in program memory before calling the handler; buffers of void and
+// arrays are checked by the handler with Check.
+template<typename T>
+struct Syscall_UserPtr {
+    T* ptr;
+
+    // Whether `count` elements at ptr lie in program memory; bytes for void
+    bool Check(u32 count) const {
+        u32 size;
+        if constexpr(Syscall_IsVoid<T>::value) {
+            size = count;
+        } else if(__builtin_mul_overflow(count, (u32)sizeof(T), &size)) {
+            return false;
+        }
+        return size == 0 || MM_IsUserAccessible(ptr, size);
+    }
+};
+
+// Copies the string at `src` into `dst`; fails if it isn't terminated within
+// `size` bytes of program memory
+bool Syscall_CopyInString(char* dst, Syscall_UserPtr<const char> src, u32 size);
+
+// How a parameter of type T is made from a register
+template<typename T>
+struct Syscall_Param {
+    static T Decode(u32 value) { return (T)value; }
+    static bool Check(u32 value) { (void)value; return true; }
+};
+
+template<typename T>
+struct Syscall_Param<T*> {
+    static_assert(Syscall_False<T>::value, "pointer parameters must be Syscall_UserPtr");
+};
+
+template<typename T>
+struct Syscall_Param<Syscall_UserPtr<T>> {
+    static Syscall_UserPtr<T> Decode(u32 value) { return { (T*)value }; }
+    static bool Check(u32 value) {
+        if constexpr(Syscall_IsVoid<T>::value) {
+            (void)value;
+            return true;
+        } else {
+            return Decode(value).Check(1);
+        }
+    }
+};
+
+template<typename Func, Func F, Syscall_Reg... Regs> struct Syscall_Thunk;
+
+// Decodes the arguments of F from the registers in Regs, in parameter
+// order, and returns its result in EAX. Returns -1 without calling F if a
+// Syscall_UserPtr argument doesn't point into program memory.
+template<typename Ret, typename... Args, Ret (*F)(Args...), Syscall_Reg... Regs>
+struct Syscall_Thunk<Ret (*)(Args...), F, Regs...> {
+    static_assert(sizeof...(Args) == sizeof...(Regs), "one register per parameter");
+
+    static void Handle(Registers* regs) {
+        if(!(Syscall_Param<Args>::Check(Syscall_Arg<Regs>(regs)) && ...)) {
+            regs->eax = (u32)-1;
+            return;
+        }
+
+        if constexpr(Syscall_IsVoid<Ret>::value) {
+            F(Syscall_Param<Args>::Decode(Syscall_Arg<Regs>(regs))...);
+            regs->eax = 0;
+        } else {
+            regs->eax = (u32)F(Syscall_Param<Args>::Decode(Syscall_Arg<Regs>(regs))...);
+        }
+    }
+};
+
+// Makes system call `id` call F directly, e.g.
+// RegisterSyscall<File_Tell, SC_EDX>(SYSCALL_TELL)
+template<auto F, Syscall_Reg... Regs>
+inline void RegisterSyscall(u32 id) {
+    RegisterSyscallHandler(id, &Syscall_Thunk<decltype(F), F, Regs...>::Handle);
+}
 
 #endif /* KERNEL_SYSCALLS_H */
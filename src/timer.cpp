@@ -2,6 +2,7 @@
 #include "timer.h"
 #include "port_io.h"
 #include "interrupts.h"
+#include "sched.h"
 
 #include "logging.h"
 static volatile u32 ticks;
@@ -9,6 +10,7 @@ static volatile u32 ticks;
 static void TimerHandler(Registers* regs) {
     (void)regs;
     ticks++;
+    Sched_Tick();
 }
 
 const u16 Divisor = 1193; // ~1kHz
@@ -27,12 +29,25 @@ void Timer_Setup() {
 }
 
 #include "logging.h"
+#include "pfalloc.h"
+
+// Does some background work, or halts until the next interrupt if there's
+// nothing to do
+static void Idle() {
+    if(!PFA_RefillZeroPool() && !PFA_Compact()) {
+        asm volatile("hlt");
+    }
+}
 
 void Sleep(u32 millis) {
     auto end = ticks + millis;
 
+    // Other threads get the CPU meanwhile
+    if(Sched_SleepUntil(end)) {
+        return;
+    }
     while(ticks < end) {
-        asm volatile("hlt");
+        Idle();
     }
 }
 
@@ -43,7 +58,10 @@ u32 TicksElapsed() {
 void SleepTicks(u32 n) {
     auto end = ticks + n;
 
+    if(Sched_SleepUntil(end)) {
+        return;
+    }
     while(ticks < end) {
-        asm volatile("hlt");
+        Idle();
     }
 }
\ No newline at end of file
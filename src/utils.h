@@ -16,5 +16,7 @@ bool strncmp(const char* lhs, const char* rhs, u32 n);
 bool strcmp(const char* lhs, const char* rhs);
 
 extern "C" void SSE_Setup();
+// Zero a 4 KiB aligned page bypassing the cache
+extern "C" void SSE_ZeroPage(void* page);
 
 #endif /* KERNEL_UTILS_H */
@@ -3,6 +3,12 @@
 #include "vm.h"
 #include "pfalloc.h"
 #include "logging.h"
+#include "memory.h"
+#include "cpu.h"
+#include "swap.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "sched.h"
 
 #define PT_PRESENT	(0x001)
 #define PT_READWRITE	(0x002)
@@ -16,221 +22,489 @@
 #define PT_CUSTOM1	(0x200)
 #define PT_CUSTOM2	(0x400)
 #define PT_CUSTOM3	(0x800)
+#define PT_NX	(1ULL << 63) // Needs EFER.NXE, reserved otherwise
 
-#define PT_ADDR_MASK 0xFFFFFF000
+// The frame is shared with other address spaces (or was), so it isn't owned
+// by this one; a reference has to be dropped when the entry goes away.
+// Shared entries of writable areas are read-only until the first write.
+#define PT_SHARED	(PT_CUSTOM1)
+
+// A not present entry with this bit set holds the swap slot of the page
+#define PT_SWAPPED	(PT_CUSTOM2)
+#define PT_IS_SWAPPED(entry) ((entry & (PT_PRESENT | PT_SWAPPED)) == PT_SWAPPED)
+#define PT_SWAP_SLOT(entry) ((u32)((entry) >> 12))
+#define PT_SWAP_ENTRY(slot) (((u64)(slot) << 12) | PT_SWAPPED)
+
+// PAE entries are 64 bits wide and frames may be anywhere below 2^52
+#define PT_ADDR_MASK (0x000FFFFFFFFFF000ULL)
 #define PD_ADDR(entry) (entry & PT_ADDR_MASK)
 #define PD_IS_PRESENT(entry) ((entry & PT_PRESENT) != 0)
 
-#define ADDR_PDI(vaddr) ((u32)vaddr >> 22)
-#define ADDR_PTI(vaddr) (((u32)vaddr >> 12) & 0x3FF)
-#define ADDR_VIRT(pdi, pti) ((void*)(((u32)pdi) * 4096 * 1024 + ((u32)pti) * 4096))
+// Page size bit of a directory entry: the entry maps 2 MiB directly
+#define PD_LARGE	(PT_ZERO)
+#define PD_LARGE_ADDR(entry) (entry & 0x000FFFFFFFE00000ULL)
+#define PD_IS_LARGE(entry) ((entry & (PT_PRESENT | PD_LARGE)) == (PT_PRESENT | PD_LARGE))
+#define LARGE_PAGE_SIZE (2 * 1024 * 1024)
+#define LARGE_PAGE_FRAMES (512)
 
-#define PAGE_PD         (1020)
-#define PAGE_RESERVED   (1021)
-#define PAGE_VMTEMP     (1022)
-#define PAGE_VGA        (1023)
+// Entries of a page table or a directory
+#define PT_ENTRIES (512)
 
-#define PAGE_RESERVED_START PAGE_PD
+// Directory entries are numbered across all four directories, 0 to 2047
+#define ADDR_PDI(vaddr) ((u32)vaddr >> 21)
+#define ADDR_PTI(vaddr) (((u32)vaddr >> 12) & 0x1FF)
+#define ADDR_VIRT(pdi, pti) ((void*)(((u32)pdi) * LARGE_PAGE_SIZE + ((u32)pti) * 4096))
 
-#define SAVE_VMTEMP() auto __vmtemp_entry = kernel_page_table[PAGE_VMTEMP]
-#define RESTORE_VMTEMP() kernel_page_table[PAGE_VMTEMP] = __vmtemp_entry
+// Every address space has one directory per GiB, all allocated up front
+#define PAE_DIRECTORIES (4)
+#define PDE_KERNEL      (ADDR_PDI(KERNEL_BASE))
 
-#define PAGE_DIRECTORY_MAX (128)
+// Fixed pages below 4 MiB: the multiboot header and the VGA framebuffer
+#define KERNEL_FIXED_PAGES  (0xC03FC000)
+#define KERNEL_FIXED_COUNT  (4)
 
-struct Page_Directory {
-    bool used;
-    u32 addr;
-};
+// The last four entries of the last directory point at the four
+// directories, which makes every page table of the current address space
+// addressable at PAGE_TABLES_BASE and the directory entries at the very top.
+#define PDE_RECURSIVE       (2044)
+#define PAGE_TABLES_BASE    (0xFF800000)
+#define PAGE_TABLE(pdi) ((volatile u64*)(PAGE_TABLES_BASE + ((u32)pdi) * 4096))
+
+// Slots of MM_MapTemporary, right below the page tables; each CPU has its
+// own, so they're only ever flushed locally
+#define KERNEL_TEMP_SLOTS   (2)
+#define KERNEL_TEMP_BASE    (PAGE_TABLES_BASE - SMP_MAX_CPUS * KERNEL_TEMP_SLOTS * 4096)
+
+// Pages of the kernel window handed out by MM_VirtualMapKernel are tracked
+// in a bitmap; the search resumes where the last one ended.
+#define KERNEL_WINDOW_PAGES ((PAGE_TABLES_BASE - KERNEL_BASE) / 4096)
+#define KERNEL_PAGE(vaddr) (((u32)(vaddr) - KERNEL_BASE) / 4096)
+
+extern u64 boot_page_directory; // defined in boot.S
+extern u64 boot_page_table; // defined in boot.S
+extern u64 boot_pdpt; // defined in boot.S
+static volatile u64* page_directory;
+static u64* kernel_page_table;
+static u32 giKernelPageDirectory;
+static u32 giKernelPageTables;
+static bool gbGlobalPages;
+static bool gbNoExecute;
+
+static u32 gaKernelPages[KERNEL_WINDOW_PAGES / 32];
+static u32 giKernelPageHint;
 
-static Page_Directory gPageDirs[PAGE_DIRECTORY_MAX];
+static inline void InvalidatePage(volatile void* vaddr) {
+    asm volatile("invlpg (%0)" : : "r"(vaddr) : "memory");
+}
 
-extern u32 boot_page_directory; // defined in boot.S
-extern u32 boot_page_table; // defined in boot.S
-static volatile u32* page_directory;
-static u32* kernel_page_table;
-static volatile u32* vmtemp;
+// Entries are written 32 bits at a time. The present bit is in the low
+// half, so the entry is not present while the high half changes.
+static void SetEntry(volatile u64* entry, u64 value) {
+    auto half = (volatile u32*)entry;
+    if(half[1] != (u32)(value >> 32)) {
+        half[0] = 0;
+        half[1] = (u32)(value >> 32);
+    }
+    half[0] = (u32)value;
+}
 
 void MM_Init() {
     kernel_page_table = &boot_page_table;
-    vmtemp = (u32*)(0xC03FE000);
-    
-    for(int i = 0; i < PAGE_DIRECTORY_MAX; i++) {
-        gPageDirs[i].used = false;
+
+    // CR3 holds the PDPT
+    giKernelPageDirectory = ((u32)&boot_pdpt) - 0xC0000000;
+    SMP_This()->page_directory = giKernelPageDirectory;
+    logprintf("vm: boot PDPT %xv %xp\n", &boot_pdpt, giKernelPageDirectory);
+
+    // Map the directories into the last one
+    auto last_dir = &boot_page_directory + (PAE_DIRECTORIES - 1) * PT_ENTRIES;
+    for(u32 i = 0; i < PAE_DIRECTORIES; i++) {
+        u32 dir = (u32)(&boot_page_directory + i * PT_ENTRIES) - 0xC0000000;
+        last_dir[PDE_RECURSIVE % PT_ENTRIES + i] = dir | PT_PRESENT | PT_READWRITE;
     }
+    page_directory = PAGE_TABLE(PDE_RECURSIVE);
 
-    // Store boot page directory
-    gPageDirs[0].addr = ((u32)&boot_page_directory) - 0xC0000000;
-    gPageDirs[0].used = true;
-    logprintf("vm: boot page directory %xv %xp\n", &boot_page_directory, gPageDirs[0].addr);
+    // Pages can't be marked no-execute without EFER.NXE
+    gbNoExecute = CPU_HasExtFeatureEDX(CPUID_EXT_FEAT_EDX_NX);
+    if(gbNoExecute) {
+        u32 lo, hi;
+        CPU_ReadMSR(MSR_EFER, &lo, &hi);
+        CPU_WriteMSR(MSR_EFER, lo | EFER_NXE, hi);
+        logprintf("vm: no-execute pages enabled\n");
+    }
 
-    // Map page directory
-    kernel_page_table[PAGE_PD] = (gPageDirs[0].addr) | PT_PRESENT | PT_READWRITE;
-    page_directory = (u32*)ADDR_VIRT(768, PAGE_PD);
+    // Kernel mappings are the same in every address space, so keep them in
+    // the TLB across CR3 writes
+    gbGlobalPages = CPU_HasFeatureEDX(CPUID_FEAT_EDX_PGE);
+    if(gbGlobalPages) {
+        // Both boot page tables
+        for(u32 pti = 0; pti < 2 * PT_ENTRIES; pti++) {
+            if(PD_IS_PRESENT(kernel_page_table[pti])) {
+                kernel_page_table[pti] |= PT_GLOBAL;
+            }
+        }
+        CPU_WriteCR4(CPU_ReadCR4() | CR4_PGE);
+        logprintf("vm: global pages enabled\n");
+    }
 }
 
-static void LoadIntoVMTemp(u32 physical) {
-    logprintf("VMTEMP: loading %x\n", physical);
-    kernel_page_table[PAGE_VMTEMP] = physical | (PT_PRESENT | PT_READWRITE);
+bool MM_HasNoExecute() {
+    return gbNoExecute;
 }
 
-static void UnloadVMTemp() {
-    //logprintf("VMTEMP: unloading\n");
-    kernel_page_table[PAGE_VMTEMP] = 0;
+static void CountPageTable(u32 pdi);
+
+// Replaces a 2 MiB mapping with a page table mapping the same frames
+static volatile u64* SplitLargePage(u32 pdi) {
+    u64 large_entry = page_directory[pdi];
+    u64 table_addr;
+
+    if(!PFA_AllocPage(&table_addr, pdi < PDE_KERNEL ? SMP_LOCAL(frame_owner) : 0)) {
+        return NULL;
+    }
+    // The directory refers to it by physical address
+    PFA_SetFlags(table_addr, PFA_FLAG_PINNED);
+
+    CountPageTable(pdi);
+    u64 pd_entry = table_addr | (large_entry & (PT_PRESENT | PT_READWRITE | PT_USER));
+    SetEntry(&page_directory[pdi], pd_entry);
+    InvalidatePage(PAGE_TABLE(pdi));
+
+    auto pt = PAGE_TABLE(pdi);
+    u64 flags = large_entry & (PT_PRESENT | PT_READWRITE | PT_USER | PT_WRITETHRU | PT_CACHEDIS | PT_GLOBAL | PT_NX);
+    for(u32 pti = 0; pti < PT_ENTRIES; pti++) {
+        SetEntry(&pt[pti], (PD_LARGE_ADDR(large_entry) + pti * 4096) | flags);
+    }
+    InvalidatePage(ADDR_VIRT(pdi, 0));
+
+    return pt;
 }
 
-static void BroadcastTableMapping(u32 idx, u32 entry) {
-    SAVE_VMTEMP();
-    for(int i = 0; i < PAGE_DIRECTORY_MAX; i++) {
-        if(gPageDirs[i].used) {
-            LoadIntoVMTemp(gPageDirs[i].addr);
-            vmtemp[idx] = entry;
+// Returns the page table covering vaddr, creating it if needed
+static volatile u64* GetPageTable(u32 pdi) {
+    // The last directory entries map the page tables themselves; treating
+    // one of them as a table would let a mapping overwrite the directory
+    ASSERT(pdi < PDE_RECURSIVE);
+    if(!PD_IS_PRESENT(page_directory[pdi])) {
+        // Allocate frame for a new page table. Kernel tables only end up here
+        // before MM_PostInit, while the boot directory is the only one.
+        u64 table_addr;
+        if(pdi < PDE_KERNEL) {
+            if(!PFA_AllocZeroed(&table_addr, SMP_LOCAL(frame_owner))) {
+                return NULL;
+            }
+            PFA_SetFlags(table_addr, PFA_FLAG_PINNED);
+        } else {
+            u32 kernel_table;
+            if(!PFA_Alloc(&kernel_table, 4096)) {
+                return NULL;
+            }
+            table_addr = kernel_table;
+        }
+        ASSERT((table_addr & PT_ADDR_MASK) == table_addr); // make sure table is 4K-aligned
+        CountPageTable(pdi);
+        // Whether programs may use a page is decided by its own entry. The
+        // no-execute bit would cover the whole table, so it's left clear.
+        SetEntry(&page_directory[pdi], table_addr | PT_PRESENT | PT_READWRITE | (pdi < PDE_KERNEL ? PT_USER : 0));
+        InvalidatePage(PAGE_TABLE(pdi));
+        if(pdi >= PDE_KERNEL) {
+            // Kernel tables are made while the kernel window itself is being
+            // set up, so there's no way to zero them in advance
+            memset((void*)PAGE_TABLE(pdi), 0, 4096);
         }
+    } else if(PD_IS_LARGE(page_directory[pdi])) {
+        return SplitLargePage(pdi);
     }
-    RESTORE_VMTEMP();
+
+    return PAGE_TABLE(pdi);
 }
 
-bool MM_VirtualMap(void* vaddr, u32 physical) {
-    bool ret = false;
+static void MarkKernelPages(u32 first, u32 count, bool used) {
+    for(u32 page = first; page < first + count; page++) {
+        if(used) {
+            gaKernelPages[page / 32] |= (1 << (page % 32));
+        } else {
+            gaKernelPages[page / 32] &= ~(1 << (page % 32));
+        }
+    }
+}
 
-    ASSERT(((u32)vaddr & PT_ADDR_MASK) == (u32)vaddr);
-    ASSERT((physical & PT_ADDR_MASK) == physical);
+// Returns the first page of a free run of `count` pages at or after `from`
+static s32 FindKernelPages(u32 count, u32 from) {
+    u32 run = 0;
+    u32 page = from;
+    while(page < KERNEL_WINDOW_PAGES) {
+        if(run == 0 && (page % 32) == 0 && gaKernelPages[page / 32] == 0xFFFFFFFF) {
+            // Skip full words
+            page += 32;
+            continue;
+        }
+        if(gaKernelPages[page / 32] & (1 << (page % 32))) {
+            run = 0;
+        } else {
+            run++;
+            if(run == count) {
+                return (s32)(page + 1 - count);
+            }
+        }
+        page++;
+    }
+    return -1;
+}
 
-    // Calculate PDT index of this vaddr
-    u32 pdi = (u32)vaddr >> 22;
-    auto pd_entry = page_directory[pdi];
-    // Map the page table
-    if(!PD_IS_PRESENT(pd_entry)) {
-        // Allocate frame for a new page table
-        u32 table_addr;
-        PFA_Alloc(&table_addr, 4096);
-        ASSERT((table_addr & 0xFFFFF000) == table_addr); // make sure table is 4K-aligned
-        pd_entry = page_directory[pdi] = table_addr | PT_PRESENT | PT_READWRITE;
-        asm volatile("mov %%cr3, %%eax\nmov %%eax, %%cr3\n":::"eax");
-        if(pdi >= 768) {
-            BroadcastTableMapping(pdi, pd_entry);
-        }
-    }
-    //logprintf("Mapping page %x to frame %x\n", vaddr, physical);
-    //kernel_page_table[PAGE_VMTEMP] = PD_ADDR(pd_entry) | (PT_PRESENT | PT_READWRITE);
-    LoadIntoVMTemp(PD_ADDR(pd_entry));
-    //logprintf("\tpdi=%x entry=%x\n", pdi, kernel_page_table[PAGE_VMTEMP]);
-    // Insert entry
-    u32 pti = ((u32)vaddr >> 12) & 0x3FF;
-    vmtemp[pti] = physical | PT_PRESENT | PT_READWRITE;
-    //logprintf("\tpti=%x entry=%x\n", pti, vmtemp[pti]);
-    // Unmap the page table
-    //kernel_page_table[PAGE_VMTEMP] = 0;
-    UnloadVMTemp();
-    ret = true;
+void MM_PostInit() {
+    // Give every kernel directory entry its page table up front. Directories
+    // copy these entries when they're created and since the tables never
+    // change, kernel mappings show up in every address space automatically.
+    u32 count = 0;
+    for(u32 pdi = PDE_KERNEL; pdi < PDE_RECURSIVE; pdi++) {
+        if(!PD_IS_PRESENT(page_directory[pdi])) {
+            if(!GetPageTable(pdi)) {
+                ASSERT(!"Can't allocate kernel page tables");
+            }
+            count++;
+        }
+    }
+    logprintf("vm: preallocated %d kernel page tables\n", count);
 
-    return ret;
+    // Whatever has been mapped so far, the fixed slots and the arenas
+    // kmalloc manages itself are off limits for MM_VirtualMapKernel
+    for(u32 pdi = PDE_KERNEL; pdi < PDE_RECURSIVE; pdi++) {
+        auto pt = PAGE_TABLE(pdi);
+        for(u32 pti = 0; pti < PT_ENTRIES; pti++) {
+            if(PD_IS_PRESENT(pt[pti])) {
+                MarkKernelPages(KERNEL_PAGE(ADDR_VIRT(pdi, pti)), 1, true);
+            }
+        }
+    }
+    MarkKernelPages(KERNEL_PAGE(KERNEL_FIXED_PAGES), KERNEL_FIXED_COUNT, true);
+    MarkKernelPages(KERNEL_PAGE(KERNEL_TEMP_BASE), SMP_MAX_CPUS * KERNEL_TEMP_SLOTS, true);
+    MarkKernelPages(KERNEL_PAGE(KERNEL_SLAB_BASE), (KERNEL_VMALLOC_END - KERNEL_SLAB_BASE) / 4096, true);
 }
 
-bool MM_VirtualUnmap(void* vaddr) {
-	bool ret = false;
+// Above this many stale entries a CR3 reload is cheaper than invlpg
+#define TLB_INVLPG_MAX (32)
 
-    ASSERT(((u32)vaddr & PT_ADDR_MASK) == (u32)vaddr);
+static void ReloadCR3() {
+    asm volatile("mov %%cr3, %%eax\nmov %%eax, %%cr3\n" : : : "eax", "memory");
+}
 
-	// Calculate PDT index of this vaddr
-    u32 pdi = (u32)vaddr >> 22;
-    auto pd_entry = page_directory[pdi];
-    // Is the page table present
-    if(PD_IS_PRESENT(pd_entry)) {
-        // Map page table
-        //kernel_page_table[PAGE_VMTEMP] = PD_ADDR(pd_entry) | (PT_PRESENT | PT_READWRITE);
-        LoadIntoVMTemp(PD_ADDR(pd_entry));
-        
-        // Clear table entry
-        u32 pti = ((u32)vaddr >> 12) & 0x3FF;
-        vmtemp[pti] = 0;
-
-        // Unmap the page table
-        //kernel_page_table[PAGE_VMTEMP] = 0;
-        UnloadVMTemp();
+void MM_FlushGlobalTLB() {
+    if(gbGlobalPages) {
+        // Toggling CR4.PGE drops global entries too
+        u32 cr4 = CPU_ReadCR4();
+        CPU_WriteCR4(cr4 & ~CR4_PGE);
+        CPU_WriteCR4(cr4);
+    } else {
+        ReloadCR3();
+    }
+}
 
-        ret = true;
+// Drops stale translations for [vaddr, vaddr + count pages)
+static void FlushRange(void* vaddr, u32 count, u32 stale) {
+    if(stale == 0) {
+        // Not-present entries are never cached
+        return;
     }
-  
-	return ret;
+
+    if(count <= TLB_INVLPG_MAX) {
+        for(u32 i = 0; i < count; i++) {
+            InvalidatePage((u8*)vaddr + i * 4096);
+        }
+    } else if((u32)vaddr >= KERNEL_BASE) {
+        MM_FlushGlobalTLB();
+    } else {
+        ReloadCR3();
+    }
+
+    // The kernel half is shared by all CPUs, the program half only by those
+    // that have the directory loaded
+    u32 pd = (u32)vaddr >= KERNEL_BASE ? 0 : SMP_LOCAL(page_directory);
+    SMP_ShootdownTLB(pd, vaddr, count <= TLB_INVLPG_MAX ? count : 0);
 }
 
-// Broadcasts a page mapping into all page directories.
-// Used when the kernel allocates memory.
-/*
-static void BroadcastMapping(void* virt, u32 entry) {
-    auto pd_idx = ADDR_PDI(virt);
-    auto pt_idx = ADDR_PTI(virt);
-    BroadcastMapping(pd_idx, pt_idx, entry);
+static u64 EntryFlags(void* vaddr, u32 flags) {
+    u64 ret = PT_PRESENT;
+    if(flags & MM_MAP_WRITE) ret |= PT_READWRITE;
+    if(flags & MM_MAP_USER) ret |= PT_USER;
+    else if(gbGlobalPages && (u32)vaddr >= KERNEL_BASE) ret |= PT_GLOBAL;
+    if(flags & MM_MAP_NOCACHE) ret |= PT_CACHEDIS;
+    if(gbNoExecute && !(flags & MM_MAP_EXEC)) ret |= PT_NX;
+    return ret;
 }
-*/
 
-static void* MM_VirtualMap_Interval(u32 physical, u32 page_count, u32 first, u32 last) {
-    void* ret = NULL;
-    ASSERT(page_count > 0);
+bool MM_VirtualMapRange(void* vaddr, u64 physical, u32 count, u32 flags) {
+    KLock_Guard guard(&gMemoryLock);
+    bool ret = true;
+    u32 stale = 0;
+    u64 entry_flags = EntryFlags(vaddr, flags);
+
+    ASSERT(((u32)vaddr & PT_ADDR_MASK) == (u32)vaddr);
+    ASSERT((physical & PT_ADDR_MASK) == physical);
+
+    u32 page = 0;
+    while(page < count && ret) {
+        auto cur = (u8*)vaddr + page * 4096;
+        u32 pdi = ADDR_PDI(cur);
+        u64 pd_entry = page_directory[pdi];
+
+        // Map whole aligned 2 MiB runs with a single directory entry, unless
+        // there's already a page table there. Kernel page tables are shared
+        // by every address space, so the kernel half never uses large pages.
+        if((flags & MM_MAP_LARGE) && pdi < PDE_KERNEL &&
+           ((u32)cur & (LARGE_PAGE_SIZE - 1)) == 0 &&
+           ((physical + page * 4096) & (LARGE_PAGE_SIZE - 1)) == 0 &&
+           count - page >= LARGE_PAGE_FRAMES &&
+           (!PD_IS_PRESENT(pd_entry) || PD_IS_LARGE(pd_entry))) {
+            if(PD_IS_PRESENT(pd_entry)) {
+                stale += LARGE_PAGE_FRAMES;
+            }
+            pd_entry = (physical + page * 4096) | entry_flags | PD_LARGE;
+            SetEntry(&page_directory[pdi], pd_entry);
+            page += LARGE_PAGE_FRAMES;
+            continue;
+        }
 
-    //logprintf("Mapping %d frames starting at %x\n", page_count, physical);
-
-    for(u32 pdi = first; pdi < last && ret == NULL; pdi++) {
-        //auto d_entry = kernel_page_subdirectory[pdi];
-        auto d_entry = page_directory[pdi];
-        if(d_entry & PT_PRESENT) {
-            auto addr = PD_ADDR(d_entry);
-            LoadIntoVMTemp(addr);
-
-            for(u32 pti = 0; pti < 1024; pti++) {
-                //logprintf("\tPDI=%d PTI=%d\n", pdi, pti);
-                if((vmtemp[pti] & PT_PRESENT) == 0) {
-                    u32 i = 0;
-                    // Can we fit `page_count` pages here?
-                    while(i < page_count && pti + i < last && (vmtemp[pti + i] & PT_PRESENT) == 0) {
-                        i++;
-                    }
-                    if(i == page_count) {
-                        // We can.
-                        ret = (void*)(pdi * 4096 * 1024 + pti * 4096);
-                        for(u32 p = 0; p < page_count; p++) {
-                            u32 entry = (physical + p * 4096) | PT_PRESENT | PT_READWRITE;
-                            vmtemp[pti + p] = entry;
-                            //logprintf("\tPDI=%d PTI=%d entry=%x\n", pdi, pti + p, vmtemp[pti + p]);
-                        }
-                        
-                        //logprintf("\tRET=%x\n", ret);
-                        
-                        break;
-                    }
+        auto pt = GetPageTable(pdi);
+        if(pt) {
+            // Fill the rest of this page table in one go
+            for(u32 pti = ADDR_PTI(cur); pti < PT_ENTRIES && page < count; pti++, page++) {
+                if(PD_IS_PRESENT(pt[pti])) {
+                    stale++;
                 }
+                SetEntry(&pt[pti], (physical + page * 4096) | entry_flags);
             }
+        } else {
+            ret = false;
+        }
+    }
+
+    FlushRange(vaddr, page, stale);
+
+    return ret;
+}
 
-            UnloadVMTemp();
+bool MM_VirtualUnmapRange(void* vaddr, u32 count) {
+    KLock_Guard guard(&gMemoryLock);
+    bool ret = false;
+    u32 stale = 0;
+
+    ASSERT(((u32)vaddr & PT_ADDR_MASK) == (u32)vaddr);
+
+    u32 page = 0;
+    while(page < count) {
+        auto cur = (u8*)vaddr + page * 4096;
+        u32 pdi = ADDR_PDI(cur);
+        u32 pti = ADDR_PTI(cur);
+        if(PD_IS_LARGE(page_directory[pdi]) && pti == 0 && count - page >= LARGE_PAGE_FRAMES) {
+            // Drop the whole 2 MiB page
+            SetEntry(&page_directory[pdi], 0);
+            stale += LARGE_PAGE_FRAMES;
+            page += LARGE_PAGE_FRAMES;
+            ret = true;
+        } else if(PD_IS_PRESENT(page_directory[pdi])) {
+            auto pt = GetPageTable(pdi);
+            if(!pt) {
+                break;
+            }
+            for(; pti < PT_ENTRIES && page < count; pti++, page++) {
+                if(PD_IS_PRESENT(pt[pti])) {
+                    stale++;
+                }
+                SetEntry(&pt[pti], 0);
+            }
+            ret = true;
         } else {
-            logprintf("PDI=%d is not present entry=%x\n", pdi, PD_ADDR(d_entry));
+            // Skip the whole table
+            page += PT_ENTRIES - pti;
         }
     }
 
+    FlushRange(vaddr, count, stale);
+
     return ret;
 }
 
-void* MM_VirtualMapProgram(u32 physical, u32 page_count) {
-    return MM_VirtualMap_Interval(physical, page_count, 0, 768);
+bool MM_VirtualMap(void* vaddr, u64 physical) {
+    return MM_VirtualMapRange(vaddr, physical, 1);
 }
 
-void* MM_VirtualMapKernel(u32 physical, u32 page_count) {
-    return MM_VirtualMap_Interval(physical, page_count, 768, 1024);
+bool MM_VirtualUnmap(void* vaddr) {
+    return MM_VirtualUnmapRange(vaddr, 1);
+}
+
+void* MM_VirtualMapKernel(u64 physical, u32 page_count, u32 flags) {
+    KLock_Guard guard(&gMemoryLock);
+    ASSERT(page_count > 0);
+
+    s32 first = FindKernelPages(page_count, giKernelPageHint);
+    if(first == -1) {
+        first = FindKernelPages(page_count, 0);
+    }
+    if(first == -1) {
+        logprintf("vm: kernel address space exhausted\n");
+        return NULL;
+    }
+
+    auto ret = (u8*)KERNEL_BASE + first * 4096;
+    MarkKernelPages(first, page_count, true);
+    if(!MM_VirtualMapRange(ret, physical, page_count, flags)) {
+        MarkKernelPages(first, page_count, false);
+        return NULL;
+    }
+    giKernelPageHint = first + page_count;
+
+    return ret;
 }
 
-bool MM_MapToPhysical(u32* out_phys, void* addr) {
+void MM_VirtualUnmapKernel(void* vaddr, u32 page_count) {
+    KLock_Guard guard(&gMemoryLock);
+    MM_VirtualUnmapRange(vaddr, page_count);
+    MarkKernelPages(KERNEL_PAGE(vaddr), page_count, false);
+}
+
+void* MM_MapTemporary(u64 physical) {
+    Preempt_Disable();
+    auto cpu = SMP_This();
+    ASSERT(cpu->temp_maps < KERNEL_TEMP_SLOTS);
+    auto ret = (u8*)KERNEL_TEMP_BASE + (cpu->index * KERNEL_TEMP_SLOTS + cpu->temp_maps) * 4096;
+    cpu->temp_maps++;
+
+    // Kernel page tables are all there after MM_PostInit
+    auto pt = GetPageTable(ADDR_PDI(ret));
+    ASSERT(pt);
+    SetEntry(&pt[ADDR_PTI(ret)], physical | EntryFlags(ret, MM_MAP_WRITE));
+    return ret;
+}
+
+void MM_UnmapTemporary(void* vaddr) {
+    auto cpu = SMP_This();
+    ASSERT(cpu->temp_maps > 0);
+    cpu->temp_maps--;
+    ASSERT(vaddr == (u8*)KERNEL_TEMP_BASE + (cpu->index * KERNEL_TEMP_SLOTS + cpu->temp_maps) * 4096);
+
+    SetEntry(&PAGE_TABLE(ADDR_PDI(vaddr))[ADDR_PTI(vaddr)], 0);
+    InvalidatePage(vaddr);
+    Preempt_Enable();
+}
+
+bool MM_MapToPhysical(u64* out_phys, void* addr) {
+    KLock_Guard guard(&gMemoryLock);
     bool ret = false;
 
     if(addr) {
         auto vaddr = ((u32)addr & 0xFFFFF000);
         auto off = (u32)addr - vaddr;
-        u32 pdi = (u32)vaddr >> 22;
-        u32 pti = ((u32)vaddr >> 12) & 0x3FF;
-        u32 pd_entry = page_directory[pdi];
-        if(pd_entry & PT_PRESENT) {
-            LoadIntoVMTemp(PD_ADDR(pd_entry));
-            auto pt = vmtemp;
-            auto pt_entry = pt[pti];
+        u32 pdi = ADDR_PDI(vaddr);
+        u32 pti = ADDR_PTI(vaddr);
+        u64 pd_entry = page_directory[pdi];
+        if(PD_IS_LARGE(pd_entry)) {
+            if(out_phys) {
+                *out_phys = PD_LARGE_ADDR(pd_entry) + ((u32)addr & (LARGE_PAGE_SIZE - 1));
+            }
+            ret = true;
+        } else if(pd_entry & PT_PRESENT) {
+            auto pt_entry = PAGE_TABLE(pdi)[pti];
             if(pt_entry & PT_PRESENT) {
                 if(out_phys) {
                     *out_phys = PD_ADDR(pt_entry) + off;
@@ -244,113 +518,1047 @@ bool MM_MapToPhysical(u32* out_phys, void* addr) {
 }
 
 void MM_PrintDiagnostic(void* addr) {
+    KLock_Guard guard(&gMemoryLock);
+    // 64-bit values are printed as high:low
     auto vaddr = ((u32)addr & 0xFFFFF000);
     auto off = (u32)addr - vaddr;
-    u32 pdi = (u32)vaddr >> 22;
-    u32 pti = ((u32)vaddr >> 12) & 0x3FF;
-    u32 pd_entry = page_directory[pdi];
-    logprintf("VM Diagnostic\n\tMemory access was %d bytes into page %x\n\tPage directory entry #%d for this was: %x\n\tPage table was %s\n",
-        off, vaddr, pdi, pd_entry, (pd_entry & PT_PRESENT) ? "PRESENT" : "NOT PRESENT");
-    if(pd_entry & PT_PRESENT) {
-        LoadIntoVMTemp(PD_ADDR(pd_entry));
-        auto pt = vmtemp;
-        auto pt_entry = pt[pti];
-        logprintf("\n\tPage table entry #%d was: %x\n\tThe page was %s\n", pti, pt_entry, (pt_entry & PT_PRESENT) ? "PRESENT" : "NOT PRESENT");
+    u32 pdi = ADDR_PDI(vaddr);
+    u32 pti = ADDR_PTI(vaddr);
+    u64 pd_entry = page_directory[pdi];
+    logprintf("VM Diagnostic\n\tMemory access was %d bytes into page %x\n\tPage directory entry #%d for this was: %x:%x\n\tPage table was %s\n",
+        off, vaddr, pdi, (u32)(pd_entry >> 32), (u32)pd_entry, (pd_entry & PT_PRESENT) ? "PRESENT" : "NOT PRESENT");
+    if(PD_IS_LARGE(pd_entry)) {
+        u64 phys = PD_LARGE_ADDR(pd_entry) + ((u32)addr & (LARGE_PAGE_SIZE - 1));
+        logprintf("\tThis is a 2 MiB page\n\tPhysical address: %x:%x\n", (u32)(phys >> 32), (u32)phys);
+    } else if(pd_entry & PT_PRESENT) {
+        u64 pt_entry = PAGE_TABLE(pdi)[pti];
+        logprintf("\n\tPage table entry #%d was: %x:%x\n\tThe page was %s\n", pti, (u32)(pt_entry >> 32), (u32)pt_entry, (pt_entry & PT_PRESENT) ? "PRESENT" : "NOT PRESENT");
         if(pt_entry & PT_PRESENT) {
-            logprintf("\tPhysical address: %x\n", PD_ADDR(pt_entry));
+            logprintf("\tPhysical address: %x:%x\n", (u32)(PD_ADDR(pt_entry) >> 32), (u32)PD_ADDR(pt_entry));
         }
     }
 }
 
 
+// A range of user memory whose frames are allocated on first touch
+struct VM_Area {
+    u32 start, end;
+    u32 flags; // MM_MAP_*
+    VM_Area* next;
+};
+
+// Free part of the user window, kept sorted by address
+struct VM_Extent {
+    u32 start, end;
+    VM_Extent* next;
+};
+
+struct Address_Space {
+    u32 pd; // PDPT
+    u64 dirs[PAE_DIRECTORIES];
+    VM_Area* areas;
+    VM_Extent* free;
+    u32 page_tables; // Frames used by user page tables
+    Address_Space* next;
+};
+
+// The scheduler looks spaces up without the memory lock
+static Spinlock gSpacesLock;
+static Address_Space* gSpaces;
+
+static void CountPageTable(u32 pdi) {
+    auto space = SMP_LOCAL(space);
+    if(pdi < PDE_KERNEL && space) {
+        space->page_tables++;
+    } else {
+        giKernelPageTables++;
+    }
+}
+
+bool MM_FreeEmptyPageTable(void* vaddr) {
+    KLock_Guard guard(&gMemoryLock);
+    u32 pdi = ADDR_PDI(vaddr);
+    ASSERT(pdi < PDE_KERNEL);
+
+    u64 pd_entry = page_directory[pdi];
+    if(!PD_IS_PRESENT(pd_entry) || PD_IS_LARGE(pd_entry)) {
+        return false;
+    }
+    auto pt = PAGE_TABLE(pdi);
+    for(u32 pti = 0; pti < PT_ENTRIES; pti++) {
+        // Swap entries count too
+        if(pt[pti] != 0) {
+            return false;
+        }
+    }
+
+    SetEntry(&page_directory[pdi], 0);
+    InvalidatePage(pt);
+    // Other CPUs on this directory may have walked through it
+    SMP_ShootdownTLB(SMP_LOCAL(page_directory));
+
+    auto space = SMP_LOCAL(space);
+    if(space) {
+        space->page_tables--;
+    } else {
+        giKernelPageTables--;
+    }
+    PFA_SetFlags(PD_ADDR(pd_entry), 0);
+    PFA_Free(PD_ADDR(pd_entry));
+
+    return true;
+}
+
+u32 MM_GetPageTableCount() {
+    KLock_Guard guard(&gMemoryLock);
+    u32 ret = giKernelPageTables;
+    for(auto space = gSpaces; space; space = space->next) {
+        // PDPT, directories and user page tables
+        ret += 1 + PAE_DIRECTORIES + space->page_tables;
+    }
+    return ret;
+}
+
+static Address_Space* FindSpace(u32 pd) {
+    Address_Space* ret = NULL;
+    u32 flags = Spin_Lock(&gSpacesLock);
+    for(auto space = gSpaces; space; space = space->next) {
+        if(space->pd == pd) {
+            ret = space;
+            break;
+        }
+    }
+    Spin_Unlock(&gSpacesLock, flags);
+    return ret;
+}
+
+// Takes [start, end) out of the free extents; fails if any of it is in use
+static bool ReserveExtent(Address_Space* space, u32 start, u32 end) {
+    for(auto prev = &space->free; *prev; prev = &(*prev)->next) {
+        auto ext = *prev;
+        if(ext->start <= start && end <= ext->end) {
+            if(ext->start == start && ext->end == end) {
+                *prev = ext->next;
+                kfree(ext);
+            } else if(ext->start == start) {
+                ext->start = end;
+            } else if(ext->end == end) {
+                ext->end = start;
+            } else {
+                auto tail = (VM_Extent*)kmalloc(sizeof(VM_Extent));
+                if(!tail) {
+                    return false;
+                }
+                tail->start = end;
+                tail->end = ext->end;
+                tail->next = ext->next;
+                ext->end = start;
+                ext->next = tail;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// First fit allocation of `size` bytes from the user window
+static bool AllocateExtent(Address_Space* space, u32* out, u32 size) {
+    for(auto ext = space->free; ext; ext = ext->next) {
+        if(ext->end - ext->start >= size) {
+            *out = ext->start;
+            return ReserveExtent(space, ext->start, ext->start + size);
+        }
+    }
+    return false;
+}
+
+static void ReleaseExtent(Address_Space* space, u32 start, u32 end) {
+    auto prev = &space->free;
+    while(*prev && (*prev)->end < start) {
+        prev = &(*prev)->next;
+    }
+
+    auto next = *prev;
+    if(next && next->end == start) {
+        // Grow the extent before us, then maybe merge it with the one after
+        next->end = end;
+        auto after = next->next;
+        if(after && after->start == end) {
+            next->end = after->end;
+            next->next = after->next;
+            kfree(after);
+        }
+    } else if(next && next->start == end) {
+        next->start = start;
+    } else {
+        auto ext = (VM_Extent*)kmalloc(sizeof(VM_Extent));
+        if(ext) {
+            ext->start = start;
+            ext->end = end;
+            ext->next = next;
+            *prev = ext;
+        } else {
+            // Leaks the range, but it stays safely unusable
+            logprintf("vm: can't release [%x, %x)\n", start, end);
+        }
+    }
+}
+
 bool AllocatePageDirectory(u32* res) {
+    KLock_Guard guard(&gMemoryLock);
     ASSERT(res);
 
+    auto space = (Address_Space*)kmalloc(sizeof(Address_Space));
+    if(!space) {
+        return false;
+    }
+
+    // The whole user window starts out free
+    space->free = (VM_Extent*)kmalloc(sizeof(VM_Extent));
+    if(!space->free) {
+        kfree(space);
+        return false;
+    }
+    space->free->start = 0;
+    space->free->end = KERNEL_BASE;
+    space->free->next = NULL;
+
+    // CR3 only takes a 32-bit address, the directories may be anywhere
     if(!PFA_Alloc(res, 4096)) {
+        kfree(space->free);
+        kfree(space);
         return false;
     }
 
-    bool ret = false;
+    bool ret = true;
+    for(u32 i = 0; i < PAE_DIRECTORIES; i++) {
+        space->dirs[i] = 0;
+    }
+    for(u32 i = 0; i < PAE_DIRECTORIES && ret; i++) {
+        ret = PFA_AllocZeroed(&space->dirs[i]);
+    }
 
-    auto pd = (u32*)MM_VirtualMapKernel(*res);
-    if(pd) {
-        memset(pd, 0, 4096);
-        // Copy kernel entries
-        for(int i = 768; i < 1024; i++) {
-            pd[i] = page_directory[i];
+    auto pdpt = ret ? (u64*)MM_VirtualMapKernel(*res) : NULL;
+    auto pd = ret ? (u64*)MM_VirtualMapKernel(space->dirs[PAE_DIRECTORIES - 1]) : NULL;
+    if(pdpt && pd) {
+        memset(pdpt, 0, 4096);
+        for(u32 i = 0; i < PAE_DIRECTORIES; i++) {
+            // PDPT entries have no access bits
+            pdpt[i] = space->dirs[i] | PT_PRESENT;
+            pd[PDE_RECURSIVE % PT_ENTRIES + i] = space->dirs[i] | PT_PRESENT | PT_READWRITE;
         }
-        ret = true;
+        // Copy kernel entries; the tables behind them never change
+        for(u32 pdi = PDE_KERNEL; pdi < PDE_RECURSIVE; pdi++) {
+            pd[pdi % PT_ENTRIES] = page_directory[pdi];
+        }
+    } else {
+        ret = false;
+    }
+
+    if(pdpt) {
+        MM_VirtualUnmapKernel(pdpt);
+    }
+    if(pd) {
+        MM_VirtualUnmapKernel(pd);
     }
 
-    MM_VirtualUnmap(pd);
+    if(ret) {
+        space->pd = *res;
+        space->areas = NULL;
+        space->page_tables = 0;
+        u32 flags = Spin_Lock(&gSpacesLock);
+        space->next = gSpaces;
+        gSpaces = space;
+        Spin_Unlock(&gSpacesLock, flags);
+    } else {
+        for(u32 i = 0; i < PAE_DIRECTORIES; i++) {
+            if(space->dirs[i]) {
+                PFA_Free(space->dirs[i]);
+            }
+        }
+        PFA_Free(*res);
+        kfree(space->free);
+        kfree(space);
+    }
 
     return ret;
 }
 
+// Drops the references the current address space holds to shared frames
+// and swap slots
+static void ReleaseSharedFrames() {
+    for(u32 pdi = 0; pdi < PDE_KERNEL; pdi++) {
+        u64 pd_entry = page_directory[pdi];
+        if(PD_IS_PRESENT(pd_entry) && !PD_IS_LARGE(pd_entry)) {
+            auto pt = PAGE_TABLE(pdi);
+            for(u32 pti = 0; pti < PT_ENTRIES; pti++) {
+                if(PD_IS_PRESENT(pt[pti]) && (pt[pti] & PT_SHARED)) {
+                    PFA_Free(PD_ADDR(pt[pti]));
+                } else if(PT_IS_SWAPPED(pt[pti])) {
+                    Swap_Free(PT_SWAP_SLOT(pt[pti]));
+                }
+            }
+        }
+    }
+}
+
 bool FreePageDirectory(u32 pd_phys) {
+    KLock_Guard guard(&gMemoryLock);
+    auto space = FindSpace(pd_phys);
+    u32 saved_pd = SMP_LOCAL(page_directory);
+
+    if(space) {
+        // The recursive mapping only reaches the current directory
+        if(SMP_LOCAL(page_directory) != pd_phys) {
+            SwitchPageDirectory(pd_phys);
+        }
+        ReleaseSharedFrames();
+    }
+
+    // Never leave CR3 pointing at a freed directory
+    if(saved_pd == pd_phys) {
+        saved_pd = giKernelPageDirectory;
+    }
+    if(SMP_LOCAL(page_directory) != saved_pd) {
+        SwitchPageDirectory(saved_pd);
+    }
+
+    if(space) {
+        // Demand allocated frames and user page tables
+        PFA_FreeAll(pd_phys);
+        for(u32 i = 0; i < PAE_DIRECTORIES; i++) {
+            PFA_Free(space->dirs[i]);
+        }
+
+        u32 flags = Spin_Lock(&gSpacesLock);
+        for(auto prev = &gSpaces; *prev; prev = &(*prev)->next) {
+            if(*prev == space) {
+                *prev = space->next;
+                break;
+            }
+        }
+        Spin_Unlock(&gSpacesLock, flags);
+        while(space->areas) {
+            auto area = space->areas;
+            space->areas = area->next;
+            kfree(area);
+        }
+        while(space->free) {
+            auto ext = space->free;
+            space->free = ext->next;
+            kfree(ext);
+        }
+        kfree(space);
+    }
+
     PFA_Free(pd_phys);
     return true;
 }
 
-void SwitchPageDirectory(u32 pd_phys) {
-    asm volatile("mov %0, %%cr3\r\n" : : "r"(pd_phys));
-    kernel_page_table[PAGE_PD] = pd_phys | PT_PRESENT | PT_READWRITE;
+// Copies the areas and free extents of src into the empty dst
+static bool CopySpaceLists(const Address_Space* src, Address_Space* dst) {
+    auto area_tail = &dst->areas;
+    for(auto area = src->areas; area; area = area->next) {
+        auto copy = (VM_Area*)kmalloc(sizeof(VM_Area));
+        if(!copy) {
+            return false;
+        }
+        *copy = *area;
+        copy->next = NULL;
+        *area_tail = copy;
+        area_tail = &copy->next;
+    }
+
+    // dst starts out with the whole window free
+    while(dst->free) {
+        auto ext = dst->free;
+        dst->free = ext->next;
+        kfree(ext);
+    }
+    auto ext_tail = &dst->free;
+    for(auto ext = src->free; ext; ext = ext->next) {
+        auto copy = (VM_Extent*)kmalloc(sizeof(VM_Extent));
+        if(!copy) {
+            return false;
+        }
+        *copy = *ext;
+        copy->next = NULL;
+        *ext_tail = copy;
+        ext_tail = &copy->next;
+    }
+
+    return true;
 }
 
-void* AllocateProgramMemory(u32 program_id, u32 pd, u32 size) {
-    void* ret = NULL;
+static VM_Area* FindArea(Address_Space* space, u32 addr);
 
-    if(kernel_page_table[PAGE_PD] != pd) {
-        SwitchPageDirectory(pd);
+// Slots of a cluster being written out without the memory lock
+static u32 giWritebackPd, giWritebackSlot, giWritebackCount;
+
+static bool IsWritebackSlot(u32 slot) {
+    return giWritebackCount > 0 && slot - giWritebackSlot < giWritebackCount;
+}
+
+// Lets a write of pages of `pd` finish. Called with the memory lock held
+// once by the caller.
+static void WaitForWriteback(u32 pd) {
+    while(giWritebackCount > 0 && giWritebackPd == pd) {
+        KLock_Release(&gMemoryLock);
+        Sched_Yield();
+        KLock_Acquire(&gMemoryLock);
+    }
+}
+
+// Fills the page table `dst_pt` of the clone from page table `pdi` of the
+// current address space `src`
+static bool ClonePageTable(Address_Space* src, u32 pdi, u64* dst_pt, u32 dst_pd) {
+    auto pt = PAGE_TABLE(pdi);
+
+    for(u32 pti = 0; pti < PT_ENTRIES; pti++) {
+        u64 entry = pt[pti];
+        u64 phys = PD_ADDR(entry);
+
+        if(!PD_IS_PRESENT(entry)) {
+            if(PT_IS_SWAPPED(entry)) {
+                // Whoever faults it in first gets a copy of their own
+                Swap_Ref(PT_SWAP_SLOT(entry));
+                dst_pt[pti] = entry;
+            }
+            continue;
+        }
+
+        // Only areas get write faults resolved, see BreakSharing
+        if(PFA_GetRefCount(phys) > 0 && PFA_GetSize(phys) == 4096 && FindArea(src, (u32)ADDR_VIRT(pdi, pti))) {
+            // Share the frame; both sides copy it on the first write
+            entry = (entry & ~PT_READWRITE) | PT_SHARED;
+            PFA_Ref(phys);
+            SetEntry(&pt[pti], entry);
+            dst_pt[pti] = entry;
+        } else {
+            // Part of a bigger allocation, which can't be shared page by
+            // page, or program memory outside the areas; the clone gets its
+            // own copy
+            u64 copy;
+            if(!PFA_AllocPage(&copy, dst_pd)) {
+                return false;
+            }
+            auto tmp = MM_MapTemporary(copy);
+            memcpy(tmp, ADDR_VIRT(pdi, pti), 4096);
+            MM_UnmapTemporary(tmp);
+            PFA_SetMapping(copy, ADDR_VIRT(pdi, pti));
+            dst_pt[pti] = copy | (entry & ~(PT_ADDR_MASK | PT_SHARED));
+        }
+    }
+
+    return true;
+}
+
+bool CloneAddressSpace(u32 src_pd, u32* res) {
+    KLock_Guard guard(&gMemoryLock);
+    // A clone can't share slots that may still fail to be written
+    WaitForWriteback(src_pd);
+    auto src = FindSpace(src_pd);
+    if(!src || !AllocatePageDirectory(res)) {
+        return false;
     }
 
-    u32 phys;
-    if(PFA_Alloc(&phys, program_id, size)) {
-        ret = MM_VirtualMapProgram(phys, (size + 4095) / 4096);
+    auto dst = FindSpace(*res);
+    bool ret = CopySpaceLists(src, dst);
+
+    // The recursive mapping only reaches the current directory, the clone
+    // is written through temporary kernel mappings. Only the directories of
+    // the program half change.
+    u32 saved_pd = SMP_LOCAL(page_directory);
+    if(SMP_LOCAL(page_directory) != src_pd) {
+        SwitchPageDirectory(src_pd);
+    }
+
+    u64* dst_dirs[PDE_KERNEL / PT_ENTRIES] = {};
+    for(u32 i = 0; i < PDE_KERNEL / PT_ENTRIES && ret; i++) {
+        dst_dirs[i] = (u64*)MM_VirtualMapKernel(dst->dirs[i]);
+        ret = dst_dirs[i] != NULL;
+    }
+
+    for(u32 pdi = 0; pdi < PDE_KERNEL && ret; pdi++) {
+        if(!PD_IS_PRESENT(page_directory[pdi])) {
+            continue;
+        }
+        // Large pages are shared 4 KiB at a time
+        if(PD_IS_LARGE(page_directory[pdi]) && !GetPageTable(pdi)) {
+            ret = false;
+            break;
+        }
+
+        u64 table_addr;
+        if(!PFA_AllocZeroed(&table_addr, *res)) {
+            ret = false;
+            break;
+        }
+        PFA_SetFlags(table_addr, PFA_FLAG_PINNED);
+        auto dst_pt = (u64*)MM_VirtualMapKernel(table_addr);
+        if(!dst_pt) {
+            PFA_Free(table_addr);
+            ret = false;
+            break;
+        }
+        dst->page_tables++;
+        // Hook the table up first so a failure below still frees everything
+        dst_dirs[pdi / PT_ENTRIES][pdi % PT_ENTRIES] = table_addr | (page_directory[pdi] & (PT_PRESENT | PT_READWRITE | PT_USER));
+        ret = ClonePageTable(src, pdi, dst_pt, *res);
+        MM_VirtualUnmapKernel(dst_pt);
+    }
+
+    for(u32 i = 0; i < PDE_KERNEL / PT_ENTRIES; i++) {
+        if(dst_dirs[i]) {
+            MM_VirtualUnmapKernel(dst_dirs[i]);
+        }
+    }
+
+    // Our own entries just became read-only
+    ReloadCR3();
+
+    if(!ret) {
+        FreePageDirectory(*res);
+    }
+    if(SMP_LOCAL(page_directory) != saved_pd) {
+        SwitchPageDirectory(saved_pd);
     }
 
     return ret;
 }
 
-void FreeProgramMemory(u32 pd, void* addr) {
-    u32 phys;
+u32 MM_GetKernelPageDirectory() {
+    return giKernelPageDirectory;
+}
 
-    if(kernel_page_table[PAGE_PD] != pd) {
-        SwitchPageDirectory(pd);
+// Called by the scheduler too, so it doesn't take the memory lock
+void SwitchPageDirectory(u32 pd_phys) {
+    // CR3 and the per-CPU copy must not end up on different CPUs
+    auto space = FindSpace(pd_phys);
+    Preempt_Disable();
+    auto cpu = SMP_This();
+    // Published first, so shootdowns for the directory don't miss this CPU
+    cpu->page_directory = pd_phys;
+    asm volatile("mov %0, %%cr3\r\n" : : "r"(pd_phys) : "memory");
+    cpu->space = space;
+    // Frames backing the user half are owned by the address space, see PFA_FreeAll
+    cpu->frame_owner = space ? pd_phys : 0;
+    Preempt_Enable();
+}
+
+bool MM_CreateArea(u32 pd, void* vaddr, u32 size, u32 flags) {
+    KLock_Guard guard(&gMemoryLock);
+    u32 start = (u32)vaddr;
+    u32 end = start + size;
+
+    ASSERT((start & 4095) == 0 && (size & 4095) == 0);
+
+    auto space = FindSpace(pd);
+    if(!space || size == 0 || end > KERNEL_BASE || end < start) {
+        return false;
+    }
+
+    auto area = (VM_Area*)kmalloc(sizeof(VM_Area));
+    if(!area) {
+        return false;
+    }
+
+    if(!ReserveExtent(space, start, end)) {
+        logprintf("vm: area [%x, %x) is already in use\n", start, end);
+        kfree(area);
+        return false;
+    }
+    area->start = start;
+    area->end = end;
+    area->flags = flags & ~MM_MAP_LARGE;
+    area->next = space->areas;
+    space->areas = area;
+
+    return true;
+}
+
+// Gives the current address space a private, writable copy of a shared
+// frame on the first write to it
+static bool BreakSharing(void* page, const VM_Area* area) {
+    u32 pdi = ADDR_PDI(page);
+    u32 pti = ADDR_PTI(page);
+    u64 pd_entry = page_directory[pdi];
+
+    if((area->flags & MM_MAP_WRITE) == 0 || !PD_IS_PRESENT(pd_entry) || PD_IS_LARGE(pd_entry)) {
+        return false;
+    }
+
+    auto pt = PAGE_TABLE(pdi);
+    u64 entry = pt[pti];
+    if(!PD_IS_PRESENT(entry) || (entry & PT_SHARED) == 0 || (entry & PT_READWRITE)) {
+        return false;
+    }
+
+    u64 phys = PD_ADDR(entry);
+    if(PFA_GetRefCount(phys) == 1) {
+        // Everyone else let go of it already
+        SetEntry(&pt[pti], entry | PT_READWRITE);
+    } else {
+        u64 copy;
+        if(!PFA_AllocPage(&copy, SMP_LOCAL(frame_owner))) {
+            return false;
+        }
+        auto tmp = MM_MapTemporary(copy);
+        memcpy(tmp, page, 4096);
+        MM_UnmapTemporary(tmp);
+
+        PFA_SetMapping(copy, page);
+        SetEntry(&pt[pti], copy | (entry & ~(PT_ADDR_MASK | PT_SHARED)) | PT_READWRITE);
+        PFA_Free(phys);
+    }
+    InvalidatePage(page);
+
+    return true;
+}
+
+static VM_Area* FindArea(Address_Space* space, u32 addr) {
+    for(auto area = space->areas; area; area = area->next) {
+        if(area->start <= addr && addr < area->end) {
+            return area;
+        }
+    }
+    return NULL;
+}
+
+// Reads a swapped out page back into a new frame. The memory lock is
+// dropped for the read; only the faulting thread changes the entry.
+static bool SwapIn(void* page, const VM_Area* area, u64 entry) {
+    u32 slot = PT_SWAP_SLOT(entry);
+    u64 phys;
+
+    if(!PFA_AllocPage(&phys, SMP_LOCAL(frame_owner))) {
+        return false;
     }
-    
-    if(MM_MapToPhysical(&phys, addr)) {
-        MM_VirtualUnmap(addr);
+    auto tmp = MM_VirtualMapKernel(phys);
+    if(!tmp) {
         PFA_Free(phys);
+        return false;
+    }
+    KLock_Release(&gMemoryLock);
+    bool ret = Swap_Read(slot, tmp);
+    KLock_Acquire(&gMemoryLock);
+    MM_VirtualUnmapKernel(tmp);
+
+    u64 pd_entry = page_directory[ADDR_PDI(page)];
+    if(ret && PD_IS_PRESENT(pd_entry) && PAGE_TABLE(ADDR_PDI(page))[ADDR_PTI(page)] == entry &&
+       MM_VirtualMapRange(page, phys, 1, area->flags)) {
+        PFA_SetMapping(phys, page);
+        Swap_Free(slot);
+        return true;
     }
+
+    PFA_Free(phys);
+    return false;
 }
 
-void* kmalloc(u32 size) {
-    void* ret = NULL;
+bool MM_HandlePageFault(void* vaddr, bool present, bool write) {
+    KLock_Guard guard(&gMemoryLock);
+    u32 addr = (u32)vaddr;
+    auto space = SMP_LOCAL(space);
+
+    if(!space) {
+        return false;
+    }
+
+    auto area = FindArea(space, addr);
+    if(!area) {
+        return false;
+    }
+
+    u64 phys;
+    auto page = (void*)(addr & 0xFFFFF000);
+    if(present) {
+        return write && BreakSharing(page, area);
+    }
 
-    ASSERT(size > 0);
+    u64 pd_entry = page_directory[ADDR_PDI(page)];
+    if(PD_IS_PRESENT(pd_entry) && !PD_IS_LARGE(pd_entry)) {
+        u64 entry = PAGE_TABLE(ADDR_PDI(page))[ADDR_PTI(page)];
+        if(PD_IS_PRESENT(entry)) {
+            // Another CPU moved the page while this fault waited for the lock
+            return true;
+        }
+        if(PT_IS_SWAPPED(entry)) {
+            if(IsWritebackSlot(PT_SWAP_SLOT(entry))) {
+                // Try again once it's on disk
+                WaitForWriteback(space->pd);
+                return true;
+            }
+            return SwapIn(page, area, entry);
+        }
+    }
+
+    if(!PFA_AllocZeroed(&phys, space->pd)) {
+        return false;
+    }
+    if(!MM_VirtualMapRange(page, phys, 1, area->flags)) {
+        PFA_Free(phys);
+        return false;
+    }
+    PFA_SetMapping(phys, page);
+    return true;
+}
 
-    if(size > 0) {
-        auto round_size = (size + 4096) & 0xFFFFF000;
-        //logprintf("Allocating memory for %d bytes (real size will be %d)\n", size, round_size);
+bool MM_IsUserAccessible(const void* vaddr, u32 size) {
+    KLock_Guard guard(&gMemoryLock);
+    u32 addr = (u32)vaddr;
+    auto space = SMP_LOCAL(space);
 
-        u32 phys;
-        PFA_Alloc(&phys, round_size);
-        ret = MM_VirtualMapKernel(phys);
-        if(ret == NULL) {
+    if(!space || size == 0 || addr + size < addr) {
+        return false;
+    }
+    for(u32 page = addr & 0xFFFFF000; page < addr + size; page += 4096) {
+        auto area = FindArea(space, page);
+        if(!area || !(area->flags & MM_MAP_USER)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Page-out works like a clock: a hand sweeps over the pages of every
+// address space in turn. Pages used since the hand last passed them get
+// their accessed bit cleared and another chance, the rest are collected
+// into clusters that go to swap with a single disk write.
+// The write happens without the memory lock. The pages of the cluster are
+// unmapped first, and the frames and slots get an extra reference, so they
+// survive the program exiting meanwhile. A program touching one of the
+// pages waits in the page fault handler until the write is done.
+
+struct Swap_Cluster {
+    u32 pd;
+    u32 slot;
+    u32 count;
+    void* pages[SWAP_CLUSTER_PAGES];
+    u64 entries[SWAP_CLUSTER_PAGES]; // Before they were unmapped
+};
+
+static u32 giSwapHandPd; // Address space the hand is in
+static u32 giSwapHandAddr;
+static bool gbSwappingOut; // One page-out at a time, it has the cluster buffer
+
+// Only private, demand allocated pages are swapped; shared frames and
+// bigger allocations stay resident
+static bool CanSwapOut(u64 entry) {
+    u64 phys = PD_ADDR(entry);
+    return
+        PD_IS_PRESENT(entry) && (entry & PT_USER) && (entry & PT_SHARED) == 0 &&
+        PFA_GetRefCount(phys) == 1 && PFA_GetSize(phys) == 4096 &&
+        (PFA_GetFlags(phys) & PFA_FLAG_PINNED) == 0;
+}
+
+// Advances the hand through the current address space until the cluster is
+// full, it holds `max_pages` or the hand reaches the end
+static void CollectCluster(Swap_Cluster* cluster, u32 max_pages) {
+    auto space = SMP_LOCAL(space);
+    cluster->pd = space->pd;
+    cluster->count = 0;
+
+    while(giSwapHandAddr < KERNEL_BASE && cluster->count < max_pages && cluster->count < SWAP_CLUSTER_PAGES) {
+        u32 pdi = ADDR_PDI(giSwapHandAddr);
+        u64 pd_entry = page_directory[pdi];
+        if(!PD_IS_PRESENT(pd_entry) || PD_IS_LARGE(pd_entry)) {
+            giSwapHandAddr = (pdi + 1) * LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        auto page = (void*)giSwapHandAddr;
+        auto pt = PAGE_TABLE(pdi);
+        u32 pti = ADDR_PTI(page);
+        giSwapHandAddr += 4096;
+
+        if(!CanSwapOut(pt[pti]) || !FindArea(space, (u32)page)) {
+            continue;
+        }
+        if(pt[pti] & PT_ACCESSED) {
+            pt[pti] &= ~PT_ACCESSED;
+            InvalidatePage(page);
+            continue;
+        }
+
+        cluster->pages[cluster->count] = page;
+        cluster->count++;
+    }
+}
+
+// Puts the frames of a cluster that couldn't be written back in place, as
+// far as their address space still exists, and drops the extra references
+static void RestoreCluster(const Swap_Cluster* cluster) {
+    auto space = FindSpace(cluster->pd);
+    if(space && SMP_LOCAL(page_directory) != cluster->pd) {
+        SwitchPageDirectory(cluster->pd);
+    }
+
+    for(u32 i = 0; i < cluster->count; i++) {
+        u64 phys = PD_ADDR(cluster->entries[i]);
+        u32 slot = cluster->slot + i;
+        auto pt = space ? PAGE_TABLE(ADDR_PDI(cluster->pages[i])) : NULL;
+        u32 pti = ADDR_PTI(cluster->pages[i]);
+
+        if(pt && pt[pti] == PT_SWAP_ENTRY(slot)) {
+            // PFA_Ref took the frame from its owner, so it's released like
+            // a shared one from now on
+            SetEntry(&pt[pti], cluster->entries[i] | PT_SHARED);
+            Swap_Free(slot);
+        } else {
+            // Freeing the address space dropped the slot already
+            PFA_Free(phys);
+        }
+        PFA_Free(phys);
+        Swap_Free(slot);
+    }
+}
+
+// Writes a cluster collected from the current address space to swap and
+// frees its frames. Returns on the directory `saved_pd`.
+static bool WriteCluster(Swap_Cluster* cluster, u32 saved_pd) {
+    auto buf = Swap_GetClusterBuffer();
+    u32 count = cluster->count;
+
+    if(!Swap_AllocSlots(&cluster->slot, count)) {
+        logprintf("vm: swap space exhausted\n");
+        return false;
+    }
+
+    // Unmap the pages before copying them, the program may be running on
+    // another CPU
+    for(u32 i = 0; i < count; i++) {
+        auto pt = PAGE_TABLE(ADDR_PDI(cluster->pages[i]));
+        u32 pti = ADDR_PTI(cluster->pages[i]);
+        cluster->entries[i] = pt[pti];
+        SetEntry(&pt[pti], PT_SWAP_ENTRY(cluster->slot + i));
+        InvalidatePage(cluster->pages[i]);
+        PFA_Ref(PD_ADDR(cluster->entries[i]));
+        Swap_Ref(cluster->slot + i);
+    }
+    SMP_ShootdownTLB(cluster->pd);
+
+    for(u32 i = 0; i < count; i++) {
+        auto tmp = MM_MapTemporary(PD_ADDR(cluster->entries[i]));
+        memcpy(buf + i * 4096, tmp, 4096);
+        MM_UnmapTemporary(tmp);
+    }
+
+    giWritebackPd = cluster->pd;
+    giWritebackSlot = cluster->slot;
+    giWritebackCount = count;
+
+    // Don't stay on a directory that may be freed during the write
+    if(SMP_LOCAL(page_directory) != saved_pd) {
+        SwitchPageDirectory(saved_pd);
+    }
+    KLock_Release(&gMemoryLock);
+    bool ret = Swap_Write(cluster->slot, buf, count);
+    KLock_Acquire(&gMemoryLock);
+
+    giWritebackCount = 0;
+
+    if(ret) {
+        // The page table entries hold on to the slots now
+        for(u32 i = 0; i < count; i++) {
+            u64 phys = PD_ADDR(cluster->entries[i]);
+            PFA_Free(phys);
             PFA_Free(phys);
+            Swap_Free(cluster->slot + i);
         }
+    } else {
+        RestoreCluster(cluster);
     }
 
+    if(SMP_LOCAL(page_directory) != saved_pd) {
+        SwitchPageDirectory(saved_pd);
+    }
     return ret;
 }
 
-void kfree(void* addr) {
-    if(addr) {
-        u32 phys;
-        if(MM_MapToPhysical(&phys, addr)) {
-            MM_VirtualUnmap(addr);
+u32 MM_SwapOut(u32 target_frames) {
+    KLock_Guard guard(&gMemoryLock);
+    u32 freed = 0;
+
+    if(!Swap_IsAvailable() || !gSpaces || target_frames == 0 || gbSwappingOut) {
+        return 0;
+    }
+    gbSwappingOut = true;
+
+    u32 space_count = 0;
+    for(auto space = gSpaces; space; space = space->next) {
+        space_count++;
+    }
+
+    // The recursive mapping only reaches the current directory. Every space
+    // is visited twice at most, the first pass may only clear accessed bits.
+    u32 saved_pd = SMP_LOCAL(page_directory);
+    u32 visit = 0;
+    while(visit <= 2 * space_count && freed < target_frames && gSpaces) {
+        // Spaces may have gone away while the last cluster was written
+        auto space = FindSpace(giSwapHandPd);
+        if(!space) {
+            space = gSpaces;
+            giSwapHandPd = space->pd;
+            giSwapHandAddr = 0;
+        }
+        if(SMP_LOCAL(page_directory) != space->pd) {
+            SwitchPageDirectory(space->pd);
+        }
+
+        Swap_Cluster cluster;
+        CollectCluster(&cluster, target_frames - freed);
+        if(giSwapHandAddr >= KERNEL_BASE) {
+            auto next = space->next ? space->next : gSpaces;
+            giSwapHandPd = next->pd;
+            giSwapHandAddr = 0;
+            visit++;
+        }
+
+        if(cluster.count > 0) {
+            if(!WriteCluster(&cluster, saved_pd)) {
+                break;
+            }
+            freed += cluster.count;
+        }
+    }
+    if(SMP_LOCAL(page_directory) != saved_pd) {
+        SwitchPageDirectory(saved_pd);
+    }
+    gbSwappingOut = false;
+
+    if(freed > 0) {
+        logprintf("vm: swapped out %d pages\n", freed);
+    }
+
+    return freed;
+}
+
+// Finds the page table entry of the current address space that maps
+// `phys` into the program half, through the reverse map pfalloc keeps.
+// Clones share the frame at the same address, so it holds for all of them.
+static volatile u64* FindUserEntry(u64 phys, void** page) {
+    if(!PFA_GetMapping(phys, page) || ADDR_PDI(*page) >= PDE_KERNEL) {
+        return NULL;
+    }
+
+    u64 pd_entry = page_directory[ADDR_PDI(*page)];
+    if(!PD_IS_PRESENT(pd_entry) || PD_IS_LARGE(pd_entry)) {
+        return NULL;
+    }
+
+    auto pte = &PAGE_TABLE(ADDR_PDI(*page))[ADDR_PTI(*page)];
+    u64 entry = *pte;
+    if(!PD_IS_PRESENT(entry) || (entry & PT_USER) == 0 || PD_ADDR(entry) != phys) {
+        return NULL;
+    }
+    return pte;
+}
+
+bool MM_CanMigrateFrame(u32 pd, u64 phys) {
+    KLock_Guard guard(&gMemoryLock);
+    if(!FindSpace(pd)) {
+        return false;
+    }
+
+    u32 saved_pd = SMP_LOCAL(page_directory);
+    if(saved_pd != pd) {
+        SwitchPageDirectory(pd);
+    }
+
+    void* page;
+    auto entry = FindUserEntry(phys, &page);
+    bool ret = entry && (*entry & PT_SHARED) == 0;
+
+    if(saved_pd != pd) {
+        SwitchPageDirectory(saved_pd);
+    }
+
+    return ret;
+}
+
+bool MM_MigrateFrame(u32 pd, u64 old_phys, u64 new_phys) {
+    KLock_Guard guard(&gMemoryLock);
+    if(!FindSpace(pd)) {
+        return false;
+    }
+
+    // The recursive mapping only reaches the current directory
+    u32 saved_pd = SMP_LOCAL(page_directory);
+    if(saved_pd != pd) {
+        SwitchPageDirectory(pd);
+    }
+
+    bool ret = false;
+    void* page;
+    auto pte = FindUserEntry(old_phys, &page);
+    if(pte && (*pte & PT_SHARED) == 0) {
+        u64 entry = *pte;
+        // Nobody may write to the page while it's copied, not even the
+        // program on another CPU
+        SetEntry(pte, 0);
+        InvalidatePage(page);
+        SMP_ShootdownTLB(pd, page, 1);
+
+        auto src = MM_MapTemporary(old_phys);
+        auto dst = MM_MapTemporary(new_phys);
+        memcpy(dst, src, 4096);
+        MM_UnmapTemporary(dst);
+        MM_UnmapTemporary(src);
+
+        PFA_SetMapping(new_phys, page);
+        SetEntry(pte, new_phys | (entry & ~PT_ADDR_MASK));
+        ret = true;
+    }
+
+    if(saved_pd != pd) {
+        SwitchPageDirectory(saved_pd);
+    }
+
+    return ret;
+}
+
+void* AllocateProgramMemory(u32 program_id, u32 pd, u32 size) {
+    KLock_Guard guard(&gMemoryLock);
+    void* ret = NULL;
+
+    if(SMP_LOCAL(page_directory) != pd) {
+        SwitchPageDirectory(pd);
+    }
+
+    auto space = SMP_LOCAL(space);
+    u32 page_count = (size + 4095) / 4096;
+    u32 phys, vaddr;
+    if(space && PFA_Alloc(&phys, program_id, page_count * 4096)) {
+        if(AllocateExtent(space, &vaddr, page_count * 4096)) {
+            if(MM_VirtualMapRange((void*)vaddr, phys, page_count, MM_MAP_WRITE | MM_MAP_USER)) {
+                PFA_SetMapping(phys, (void*)vaddr);
+                ret = (void*)vaddr;
+            } else {
+                ReleaseExtent(space, vaddr, vaddr + page_count * 4096);
+            }
+        }
+        if(!ret) {
             PFA_Free(phys);
         }
     }
+
+    return ret;
+}
+
+void FreeProgramMemory(u32 pd, void* addr) {
+    KLock_Guard guard(&gMemoryLock);
+    u64 phys;
+
+    if(SMP_LOCAL(page_directory) != pd) {
+        SwitchPageDirectory(pd);
+    }
+
+    auto space = SMP_LOCAL(space);
+    if(space && MM_MapToPhysical(&phys, addr)) {
+        u32 size = PFA_GetSize(phys);
+        MM_VirtualUnmapRange(addr, size / 4096);
+        ReleaseExtent(space, (u32)addr, (u32)addr + size);
+        PFA_Free(phys);
+    }
 }
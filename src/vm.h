@@ -1,21 +1,92 @@
 #ifndef KERNEL_VM_H
 #define KERNEL_VM_H
 
+// Kernel virtual address space layout
+#define KERNEL_BASE         (0xC0000000)
+#define KERNEL_FRAMES_BASE  (0xC0400000) // Page frame descriptors (pfalloc)
+#define KERNEL_SLAB_BASE    (0xD0000000) // Slab arena (kmalloc)
+#define KERNEL_SLAB_END     (0xD8000000)
+#define KERNEL_VMALLOC_BASE (0xD8000000) // Large kmalloc buffers
+#define KERNEL_VMALLOC_END  (0xE0000000)
+
+// Mapping flags
+#define MM_MAP_WRITE    (0x01)
+#define MM_MAP_USER     (0x02)
+#define MM_MAP_NOCACHE  (0x04)
+#define MM_MAP_LARGE    (0x08) // Use 2 MiB pages where alignment allows
+#define MM_MAP_EXEC     (0x10) // Code may run from it; no-execute otherwise
+
 void MM_Init();
-bool MM_VirtualMap(void* vaddr, u32 physical);
+// Called once the page frame allocator is up
+void MM_PostInit();
+// Whether the CPU enforces MM_MAP_EXEC
+bool MM_HasNoExecute();
+bool MM_VirtualMap(void* vaddr, u64 physical);
 bool MM_VirtualUnmap(void* vaddr);
+// Releases the page table covering `vaddr` in the program half of the
+// current directory if nothing is mapped through it anymore. Directories of
+// address spaces free their tables along with them; this is for the kernel
+// directory.
+bool MM_FreeEmptyPageTable(void* vaddr);
+
+// Map `count` consecutive frames starting at `physical` to `vaddr`.
+// The TLB is invalidated once for the whole range.
+bool MM_VirtualMapRange(void* vaddr, u64 physical, u32 count, u32 flags = MM_MAP_WRITE);
+bool MM_VirtualUnmapRange(void* vaddr, u32 count);
+
+// Flush the whole TLB, including global (kernel) entries
+void MM_FlushGlobalTLB();
 
 // Map frame(s) somewhere into the kernel address-space
-void* MM_VirtualMapKernel(u32 physical, u32 page_count = 1);
+void* MM_VirtualMapKernel(u64 physical, u32 page_count = 1, u32 flags = MM_MAP_WRITE);
+// Unmap and release pages returned by MM_VirtualMapKernel
+void MM_VirtualUnmapKernel(void* vaddr, u32 page_count = 1);
+// Maps a single frame at a slot of this CPU, for a short copy or clear.
+// Preemption stays disabled until MM_UnmapTemporary, so nothing in between
+// may sleep; mappings are undone in reverse order.
+void* MM_MapTemporary(u64 physical);
+void MM_UnmapTemporary(void* vaddr);
 
 // Translate virtual address to physical address
-bool MM_MapToPhysical(u32* out_phys, void* addr);
+bool MM_MapToPhysical(u64* out_phys, void* addr);
 
 void MM_PrintDiagnostic(void* vaddr);
 
+// Number of frames used for page directories and page tables
+u32 MM_GetPageTableCount();
+
+// Directory holding nothing but the kernel mappings
+u32 MM_GetKernelPageDirectory();
+
+// Directories are named by the physical address of their PDPT, which is
+// what CR3 holds, so they always come from the first 4 GiB
+
 bool AllocatePageDirectory(u32* res);
 bool FreePageDirectory(u32 pd_phys);
 void SwitchPageDirectory(u32 pd_phys);
+// Create a copy of the address space of `src_pd`. Frames are shared
+// copy-on-write, so only pages written later get duplicated.
+bool CloneAddressSpace(u32 src_pd, u32* res);
+
+// Reserve [vaddr, vaddr + size) in the address space of `pd`. Frames are
+// allocated and zeroed when the range is first touched.
+bool MM_CreateArea(u32 pd, void* vaddr, u32 size, u32 flags = MM_MAP_WRITE);
+// Resolves a fault on a reserved area, either by backing it or by breaking
+// copy-on-write sharing; returns false if the fault is fatal
+bool MM_HandlePageFault(void* vaddr, bool present, bool write);
+// Whether [vaddr, vaddr + size) lies in areas of the current address space
+// that programs may access
+bool MM_IsUserAccessible(const void* vaddr, u32 size);
+
+// Writes up to `target_frames` rarely used program pages out to swap;
+// returns how many frames were freed
+u32 MM_SwapOut(u32 target_frames);
+
+// Copies the program page of address space `pd` at `old_phys` to
+// `new_phys` and points its page table entry there; used by compaction
+bool MM_MigrateFrame(u32 pd, u64 old_phys, u64 new_phys);
+// Whether MM_MigrateFrame would find the page
+bool MM_CanMigrateFrame(u32 pd, u64 phys);
 
 // Allocate virtual memory for a program
 void* AllocateProgramMemory(u32 program_id, u32 pd, u32 size);
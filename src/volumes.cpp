@@ -5,6 +5,7 @@
 #include "logging.h"
 #include "interrupts.h"
 #include "syscalls.h"
+#include "spinlock.h"
 
 #define MAX_VOLUMES (128)
 #define MAX_FILESYSTEMS (8)
@@ -24,8 +25,12 @@ static Volume_State gaVolumes[MAX_VOLUMES];
 static u32 giVolumesLastIndex = 1; // vol #0 is reserved, see below
 static Filesystem_Descriptor* gaFilesystems[MAX_FILESYSTEMS];
 static u32 giFilesystemsLastIndex = 0;
+// Guards the volumes, the open files and the filesystem drivers' state.
+// Taken before the memory and disk locks.
+static Kernel_Lock gVolumesLock;
 
 Volume_Handle Volume_Register(const Volume_Descriptor* vol) {
+    KLock_Guard guard(&gVolumesLock);
     Volume_Handle ret;
     ASSERT(giVolumesLastIndex < MAX_VOLUMES);
 
@@ -58,6 +63,7 @@ Filesystem* Volume_Get_Filesystem(Volume_Handle vol) {
 }
 
 s32 Volume_Read_Blocks(Volume_Handle vol, void* buffer, u32 offset, u32 count) {
+    KLock_Guard guard(&gVolumesLock);
     s32 ret = -1;
 
     if(vol < giVolumesLastIndex && buffer) {
@@ -81,6 +87,7 @@ s32 Volume_Read_Blocks(Volume_Handle vol, void* buffer, u32 offset, u32 count) {
 }
 
 s32 Volume_Write_Blocks(Volume_Handle vol, const void* buffer, u32 offset, u32 count) {
+    KLock_Guard guard(&gVolumesLock);
     s32 ret = -1;
 
     ASSERT(vol < giVolumesLastIndex);
@@ -132,6 +139,7 @@ static void Volume_Detect_Filesystems() {
 }
 
 void Filesystem_Register_Filesystem(Filesystem_Register init) {
+    KLock_Guard guard(&gVolumesLock);
     if(giFilesystemsLastIndex < MAX_FILESYSTEMS) {
         gaFilesystems[giFilesystemsLastIndex] = init();
         giFilesystemsLastIndex++;
@@ -151,6 +159,7 @@ struct File_Handle_Mapping {
 static File_Handle_Mapping gaFDMap[MAX_OPEN_FILES];
 
 int File_Open(Volume_Handle volume, const char* path, mode_t flags) {
+    KLock_Guard guard(&gVolumesLock);
     int ret = -1;
 
     logprintf("File_Open(%x, %s, %x)\n", volume, path, flags);
@@ -186,7 +195,8 @@ int File_Open(Volume_Handle volume, const char* path, mode_t flags) {
 }
 
 void File_Close(int fd) {
-    if(fd < MAX_OPEN_FILES) {
+    KLock_Guard guard(&gVolumesLock);
+    if(fd >= 0 && fd < MAX_OPEN_FILES) {
         if(gaFDMap[fd].used) {
             auto& f = gaFDMap[fd];
             ASSERT(f.vol < giVolumesLastIndex);
@@ -202,6 +212,7 @@ void File_Close(int fd) {
 }
 
 int File_Read(void* ptr, u32 size, u32 nmemb, int fd) {
+    KLock_Guard guard(&gVolumesLock);
     int ret = -1;
 
     if(ptr && size > 0 && fd >= 0 && fd < MAX_OPEN_FILES) {
@@ -229,6 +240,7 @@ int File_Read(void* ptr, u32 size, u32 nmemb, int fd) {
 }
 
 int File_Write(const void* ptr, u32 size, u32 nmemb, int fd) {
+    KLock_Guard guard(&gVolumesLock);
     int ret = -1;
 
     if(ptr && size > 0 && fd >= 0 && fd < MAX_OPEN_FILES) {
@@ -256,6 +268,7 @@ int File_Write(const void* ptr, u32 size, u32 nmemb, int fd) {
 }
 
 void File_Seek(int fd, s32 offset, whence_t whence) {
+    KLock_Guard guard(&gVolumesLock);
     if(fd >= 0 && fd < MAX_OPEN_FILES) {
         if(gaFDMap[fd].used) {
             auto& f = gaFDMap[fd];
@@ -273,6 +286,7 @@ void File_Seek(int fd, s32 offset, whence_t whence) {
 }
 
 int File_Tell(int fd) {
+    KLock_Guard guard(&gVolumesLock);
     int ret = -1;
 
     if(fd >= 0 && fd < MAX_OPEN_FILES) {
@@ -290,6 +304,7 @@ int File_Tell(int fd) {
 }
 
 void Sync(Volume_Handle volume) {
+    KLock_Guard guard(&gVolumesLock);
     ASSERT(volume < giVolumesLastIndex);
     auto& V = gaVolumes[volume];
     if(V.filesystem.desc && V.filesystem.desc->Sync) {
@@ -298,6 +313,7 @@ void Sync(Volume_Handle volume) {
 }
 
 int File_EOF(int fd) {
+    KLock_Guard guard(&gVolumesLock);
     int ret = -1;
     
     if(fd >= 0 && fd < MAX_OPEN_FILES) {
@@ -314,30 +330,45 @@ int File_EOF(int fd) {
     return ret;
 }
 
-static void SC_Handler(Registers* regs) {
-    int res = regs->eax;
-    switch(regs->eax) {
-        case SYSCALL_OPEN:
-        res = File_Open(regs->ebx, (char*)regs->edx, regs->ecx);
-        break;
-        case SYSCALL_CLOSE:
-        File_Close(regs->ebx);
-        break;
-        case SYSCALL_READ:
-        res = File_Read((void*)regs->edi, regs->ebx, regs->ecx, regs->edx);
-        break;
-        case SYSCALL_WRITE:
-        res = File_Write((void*)regs->esi, regs->ebx, regs->ecx, regs->edx);
-        break;
-        case SYSCALL_SEEK:
-        res = 0;
-        File_Seek(regs->edx, regs->ecx, (whence_t)regs->ebx);
-        break;
-        case SYSCALL_TELL:
-        res = File_Tell(regs->edx);
-        break;
+// System call entries. The File_* functions trust their pointers, the
+// kernel calls them with its own buffers too.
+
+template<typename T>
+static bool IsUserBuffer(Syscall_UserPtr<T> ptr, u32 size, u32 nmemb) {
+    u32 bytes;
+    return !__builtin_mul_overflow(size, nmemb, &bytes) && ptr.Check(bytes);
+}
+
+static bool IsSpecialVolume(Volume_Handle volume) {
+    KLock_Guard guard(&gVolumesLock);
+    return volume < giVolumesLastIndex && gaVolumes[volume].virt;
+}
+
+static int SC_Open(Volume_Handle volume, Syscall_UserPtr<const char> path, mode_t flags) {
+    char buf[SYSCALL_PATH_MAX];
+    if(!Syscall_CopyInString(buf, path, sizeof(buf))) {
+        return -1;
+    }
+    // The mem device reads and writes kernel memory, it's for the kernel only
+    if(IsSpecialVolume(volume) && strcmp("mem", buf)) {
+        logprintf("VolMan: programs may not open mem\n");
+        return -1;
+    }
+    return File_Open(volume, buf, flags);
+}
+
+static int SC_Read(Syscall_UserPtr<void> ptr, u32 size, u32 nmemb, int fd) {
+    if(!IsUserBuffer(ptr, size, nmemb)) {
+        return -1;
+    }
+    return File_Read(ptr.ptr, size, nmemb, fd);
+}
+
+static int SC_Write(Syscall_UserPtr<const void> ptr, u32 size, u32 nmemb, int fd) {
+    if(!IsUserBuffer(ptr, size, nmemb)) {
+        return -1;
     }
-    regs->eax = res;
+    return File_Write(ptr.ptr, size, nmemb, fd);
 }
 
 static void ReserveSpecialVolume() {
@@ -348,6 +379,7 @@ static void ReserveSpecialVolume() {
 }
 
 void Volume_Init() {
+    KLock_Guard guard(&gVolumesLock);
     logprintf("VolMan: initializing\n");
     // Register special volume
     ReserveSpecialVolume();
@@ -357,11 +389,11 @@ void Volume_Init() {
     Volume_Detect_Filesystems();
 
     // Register syscalls
-    RegisterSyscallHandler(SYSCALL_OPEN, SC_Handler);
-    RegisterSyscallHandler(SYSCALL_CLOSE, SC_Handler);
-    RegisterSyscallHandler(SYSCALL_READ, SC_Handler);
-    RegisterSyscallHandler(SYSCALL_WRITE, SC_Handler);
-    RegisterSyscallHandler(SYSCALL_SEEK, SC_Handler);
-    RegisterSyscallHandler(SYSCALL_TELL, SC_Handler);
+    RegisterSyscall<SC_Open, SC_EBX, SC_EDX, SC_ECX>(SYSCALL_OPEN);
+    RegisterSyscall<File_Close, SC_EBX>(SYSCALL_CLOSE);
+    RegisterSyscall<SC_Read, SC_EDI, SC_EBX, SC_ECX, SC_EDX>(SYSCALL_READ);
+    RegisterSyscall<SC_Write, SC_ESI, SC_EBX, SC_ECX, SC_EDX>(SYSCALL_WRITE);
+    RegisterSyscall<File_Seek, SC_EDX, SC_ECX, SC_EBX>(SYSCALL_SEEK);
+    RegisterSyscall<File_Tell, SC_EDX>(SYSCALL_TELL);
     logprintf("VolMan: ready\n");
 }
\ No newline at end of file